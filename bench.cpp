@@ -0,0 +1,438 @@
+/*! \file bench.cpp
+ *  \brief Benchmarks for the wave-share modem
+ *  \author Georgi Gerganov
+ *
+ *  Times the DSP kernels (FFT, Tx tone mixing), the Reed-Solomon codec and the whole
+ *  Tx/Rx paths on synthetic data, and writes the results as JSON, so that two builds can
+ *  be compared. The library source is compiled into this translation unit to give the
+ *  benchmarks access to the internal kernels. The decoded messages are checked as well, and
+ *  the exit status is nonzero if one of them is wrong.
+ *
+ *  Usage: wave-share-bench [output.json] [-q]
+ *      output.json - where to write the results (default: wave-share-bench.json)
+ *      -q          - quick run: fewer repetitions, for smoke testing
+ */
+
+#if defined(__GNUC__) && !defined(__clang__)
+// the library types live in an anonymous namespace, which GCC only expects in the main file
+#pragma GCC diagnostic ignored "-Wsubobject-linkage"
+#endif
+
+#include "wave-share.cpp"
+
+#include <cstdlib>
+#include <functional>
+
+namespace {
+
+struct Protocol {
+    const char * name;
+    ::Modulation modulation;
+    int freqDelta;
+    int freqStart;
+    int framesPerTx;
+    int bytesPerTx;
+};
+
+// the Tx protocols of the frontends
+const Protocol kProtocols[] = {
+    { "normal",            ::Modulation::NibbleFSK,        1, 40,  9, 3 },
+    { "fast",              ::Modulation::NibbleFSK,        1, 40,  6, 3 },
+    { "fastest",           ::Modulation::NibbleFSK,        1, 40,  3, 3 },
+    { "ultrasonic",        ::Modulation::NibbleFSK,        1, 320, 9, 3 },
+    { "normal-multitone",  ::Modulation::CombinatorialFSK, 1, 40,  9, 6 },
+    { "fast-multitone",    ::Modulation::CombinatorialFSK, 1, 40,  6, 6 },
+    { "fastest-multitone", ::Modulation::CombinatorialFSK, 1, 40,  3, 6 },
+    { "normal-ofdm",       ::Modulation::DifferentialOFDM, 1, 40,  9, 3 },
+    { "fast-ofdm",         ::Modulation::DifferentialOFDM, 1, 40,  6, 3 },
+    { "fastest-ofdm",      ::Modulation::DifferentialOFDM, 1, 40,  3, 3 },
+};
+
+const char * kRxModeNames[] = { "spectrum", "tonebank", "slidingdft" };
+
+struct Result {
+    std::string name;
+    std::string params;
+    int iterations;
+    double mean_us;
+    double median_us;
+    double min_us;
+};
+
+std::vector<Result> g_results;
+int g_nFailedChecks = 0;
+double g_minTime_ms = 250.0;
+int g_minRepetitions = 5;
+
+// Runs func repeatedly - one warm-up call, then at least g_minRepetitions timed calls and
+// until g_minTime_ms have passed. Each call may do batch operations, the results are per
+// operation.
+void run(const std::string & name, const std::string & params, int batch, const std::function<void()> & func) {
+    using Clock = std::chrono::steady_clock;
+
+    func();
+
+    std::vector<double> times_us;
+    double total_ms = 0.0;
+    while ((int) times_us.size() < g_minRepetitions || total_ms < g_minTime_ms) {
+        auto tStart = Clock::now();
+        func();
+        auto tEnd = Clock::now();
+
+        double dt_us = std::chrono::duration_cast<std::chrono::nanoseconds>(tEnd - tStart).count()/1000.0;
+        times_us.push_back(dt_us/batch);
+        total_ms += dt_us/1000.0;
+    }
+
+    Result res;
+    res.name = name;
+    res.params = params;
+    res.iterations = times_us.size()*batch;
+
+    double sum = 0.0;
+    for (auto t : times_us) sum += t;
+    res.mean_us = sum/times_us.size();
+
+    std::sort(times_us.begin(), times_us.end());
+    res.median_us = times_us[times_us.size()/2];
+    res.min_us = times_us[0];
+
+    fprintf(stderr, "%-22s %-32s %12.3f us (min %.3f us)\n", res.name.c_str(), res.params.c_str(), res.median_us, res.min_us);
+    g_results.push_back(res);
+}
+
+// deterministic pseudo-random numbers, so that every run works on the same data
+unsigned g_seed = 1;
+unsigned nextRandom() {
+    g_seed = g_seed*1103515245u + 12345u;
+    return g_seed >> 8;
+}
+
+float noise() {
+    return (nextRandom() & 0xffff)/65536.0f - 0.5f;
+}
+
+std::string makeText(int length) {
+    std::string text(length, ' ');
+    for (auto & c : text) c = 'a' + nextRandom()%26;
+    return text;
+}
+
+void setProtocol(Encoder & encoder, const Protocol & protocol) {
+    encoder.setTxMode(::TxMode::VariableLength);
+    encoder.setModulation(protocol.modulation);
+    encoder.setParameters(protocol.freqDelta, protocol.freqStart, protocol.framesPerTx, protocol.bytesPerTx, 50);
+}
+
+void setProtocol(Decoder & decoder, const Protocol & protocol) {
+    decoder.setTxMode(::TxMode::VariableLength);
+    decoder.setModulation(protocol.modulation);
+    decoder.setParameters(protocol.freqDelta, protocol.freqStart, protocol.framesPerTx, protocol.bytesPerTx);
+}
+
+void benchFFT() {
+    for (int N = 64; N <= ::kMaxSamplesPerFrame; N *= 2) {
+        ::FFTPlan plan;
+        plan.init(N);
+
+        std::vector<float> src(N);
+        for (auto & x : src) x = noise();
+
+        std::vector<std::complex<float>> work(N);
+        std::vector<float> spectrum(N/2 + 1);
+
+        const int batch = 64;
+        std::string params = "N=" + std::to_string(N);
+
+        run("fft_complex", params, batch, [&]() {
+            for (int i = 0; i < batch; ++i) ::FFT(plan, src.data(), work.data(), 1.0f);
+        });
+
+        run("fft_power_spectrum", params, batch, [&]() {
+            for (int i = 0; i < batch; ++i) ::FFTPowerSpectrum(plan, src.data(), spectrum.data(), work.data());
+        });
+    }
+}
+
+void benchMixTones() {
+    const int nMaxTones = 48;
+
+    std::vector<::AmplitudeData> tones(nMaxTones);
+    std::array<const float *, nMaxTones> tonePtrs;
+    for (int t = 0; t < nMaxTones; ++t) {
+        for (auto & x : tones[t]) x = noise();
+        tonePtrs[t] = tones[t].data();
+    }
+
+    ::AmplitudeData dst;
+
+    for (int nTones : { 16, 24, 48 }) {
+        const int batch = 64;
+        run("mix_tones", "tones=" + std::to_string(nTones) + " N=" + std::to_string(::kMaxSamplesPerFrame), batch, [&]() {
+            for (int i = 0; i < batch; ++i) {
+                dst.fill(0.0f);
+                ::mixTonesSmooth(tonePtrs.data(), nTones, dst, 0.5f, ::kMaxSamplesPerFrame, i%9, 9);
+            }
+        });
+    }
+}
+
+void benchInit() {
+    std::string text = makeText(64);
+
+    for (const auto & protocol : kProtocols) {
+        DataRxTx data(::kBaseSampleRate, ::kBaseSampleRate, ::kMaxSamplesPerFrame);
+        data.txMode = ::TxMode::VariableLength;
+        data.modulation = protocol.modulation;
+        data.paramFreqDelta = protocol.freqDelta;
+        data.paramFreqStart = protocol.freqStart;
+        data.paramFramesPerTx = protocol.framesPerTx;
+        data.paramBytesPerTx = protocol.bytesPerTx;
+
+        run("init", std::string("protocol=") + protocol.name, 1, [&]() {
+            data.init(text.size(), text.data());
+        });
+    }
+}
+
+void benchSend() {
+    for (int length : { 16, ::kMaxLength }) {
+        std::string text = makeText(length);
+
+        for (const auto & protocol : kProtocols) {
+            Encoder encoder;
+            setProtocol(encoder, protocol);
+
+            std::vector<int16_t> samples;
+            run("send", std::string("protocol=") + protocol.name + " length=" + std::to_string(length), 1, [&]() {
+                samples.clear();
+                encoder.setText(text.data(), text.size());
+                encoder.encode(samples);
+            });
+        }
+    }
+}
+
+// Times encoding and decoding with up to nECC/2 errors. Codec is the runtime codec or one of
+// the compile-time specialized ones
+template <typename Codec>
+void benchReedSolomon(Codec & rs, const std::string & name, int length, int nECC) {
+    std::string text = makeText(length);
+    std::vector<uint8_t> encoded(length + nECC);
+    std::vector<uint8_t> corrupted(length + nECC);
+    std::vector<uint8_t> decoded(length);
+
+    const int batch = 16;
+    std::string params = "length=" + std::to_string(length) + " ecc=" + std::to_string(nECC);
+
+    run(name + "_encode", params, batch, [&]() {
+        for (int i = 0; i < batch; ++i) rs.Encode(text.data(), encoded.data());
+    });
+
+    // up to the correction limit of nECC/2 errors
+    int nErrorsLast = -1;
+    for (int nErrors : { 0, 1, nECC/4, nECC/2 }) {
+        if (nErrors <= nErrorsLast) continue;
+        nErrorsLast = nErrors;
+
+        std::vector<int> errorPos(length + nECC);
+        for (int i = 0; i < (int) errorPos.size(); ++i) errorPos[i] = i;
+        for (int i = 0; i < nErrors; ++i) std::swap(errorPos[i], errorPos[i + nextRandom()%(errorPos.size() - i)]);
+
+        corrupted = encoded;
+        for (int i = 0; i < nErrors; ++i) corrupted[errorPos[i]] ^= 1 + nextRandom()%255;
+
+        bool isOk = true;
+        run(name + "_decode", params + " errors=" + std::to_string(nErrors), batch, [&]() {
+            for (int i = 0; i < batch; ++i) {
+                if (rs.Decode(corrupted.data(), decoded.data()) != 0) isOk = false;
+            }
+        });
+
+        if (isOk == false || std::equal(decoded.begin(), decoded.end(), text.begin()) == false) {
+            fprintf(stderr, "%s_decode: failed to correct %d errors\n", name.c_str(), nErrors);
+            ++g_nFailedChecks;
+        }
+    }
+}
+
+void benchReedSolomon() {
+    for (int length : { 16, ::kMaxLength }) {
+        const int nECC = ::getECCBytesForLength(length);
+
+        RS::ReedSolomon rs(length, nECC);
+        benchReedSolomon(rs, "rs", length, nECC);
+    }
+
+    ::FixedLengthRS rsFixed;
+    benchReedSolomon(rsFixed, "rs_fixed", ::kDefaultFixedLength, ::kDefaultFixedECCBytes);
+}
+
+void benchReceive() {
+    std::string text = makeText(32);
+
+    for (const auto & protocol : kProtocols) {
+        // the message between two seconds of noise at -40 dB
+        std::vector<int16_t> samples(2*::kBaseSampleRate, 0);
+        {
+            Encoder encoder;
+            setProtocol(encoder, protocol);
+            encoder.setText(text.data(), text.size());
+            encoder.encode(samples);
+        }
+        samples.resize(samples.size() + 2*::kBaseSampleRate, 0);
+
+        std::vector<float> recording(samples.size());
+        for (int i = 0; i < (int) samples.size(); ++i) {
+            recording[i] = 0.5f*samples[i]/32768.0f + 0.01f*noise();
+        }
+
+        for (int rxMode = 0; rxMode < 3; ++rxMode) {
+            Decoder decoder;
+            setProtocol(decoder, protocol);
+            decoder.setRxMode((::RxMode)(rxMode));
+
+            // the frames of a capture callback
+            const int nChunk = decoder.getSamplesPerFrame();
+
+            int nDecoded = 0;
+            int nRuns = 0;
+            run("receive", std::string("protocol=") + protocol.name + " rx=" + kRxModeNames[rxMode], 1, [&]() {
+                for (int i = 0; i < (int) recording.size(); i += nChunk) {
+                    nDecoded += decoder.decode(recording.data() + i, std::min(nChunk, (int) recording.size() - i));
+                }
+                ++nRuns;
+            });
+
+            if (nDecoded != nRuns) {
+                fprintf(stderr, "receive: decoded %d messages in %d runs\n", nDecoded, nRuns);
+                ++g_nFailedChecks;
+            }
+            if (decoder.getRxDataLength() != (int) text.size()) {
+                fprintf(stderr, "receive: decoded length %d instead of %d\n", decoder.getRxDataLength(), (int) text.size());
+                ++g_nFailedChecks;
+            }
+        }
+    }
+}
+
+// Round trip of a FixedLength message - the payload is always kDefaultFixedLength bytes, the
+// text padded with zeros
+void checkFixedLength() {
+    std::string text = makeText(32);
+    const auto & protocol = kProtocols[1];
+
+    std::vector<int16_t> samples(::kBaseSampleRate/2, 0);
+    Encoder encoder;
+    setProtocol(encoder, protocol);
+    encoder.setTxMode(::TxMode::FixedLength);
+    encoder.setText(text.data(), text.size());
+    encoder.encode(samples);
+    samples.resize(samples.size() + ::kBaseSampleRate, 0);
+
+    std::vector<float> recording(samples.size());
+    for (int i = 0; i < (int) samples.size(); ++i) {
+        recording[i] = 0.5f*samples[i]/32768.0f;
+    }
+
+    Decoder decoder;
+    setProtocol(decoder, protocol);
+    decoder.setTxMode(::TxMode::FixedLength);
+    int nDecoded = decoder.decode(recording.data(), recording.size());
+
+    std::string expected = text + std::string(::kDefaultFixedLength - text.size(), '\0');
+    if (nDecoded != 1 || decoder.getRxDataLength() != ::kDefaultFixedLength ||
+        memcmp(decoder.getRxData(), expected.data(), expected.size()) != 0) {
+        fprintf(stderr, "fixed length: decoded %d messages of length %d\n", nDecoded, decoder.getRxDataLength());
+        ++g_nFailedChecks;
+    }
+}
+
+// Listening to noise at -40 dB, with no message in it - the cost per frame of each receiver
+// while it waits for a start marker
+void benchIdle() {
+    std::vector<float> recording(4*::kBaseSampleRate);
+    for (auto & x : recording) x = 0.01f*noise();
+
+    for (int rxMode = 0; rxMode < 3; ++rxMode) {
+        Decoder decoder;
+        setProtocol(decoder, kProtocols[1]);
+        decoder.setRxMode((::RxMode)(rxMode));
+
+        const int nChunk = decoder.getSamplesPerFrame();
+        const int nFrames = recording.size()/nChunk;
+
+        run("idle", std::string("rx=") + kRxModeNames[rxMode], nFrames, [&]() {
+            for (int i = 0; i + nChunk <= (int) recording.size(); i += nChunk) {
+                decoder.decode(recording.data() + i, nChunk);
+            }
+        });
+    }
+}
+
+void writeJSON(FILE * fout) {
+    fprintf(fout, "{\n");
+    fprintf(fout, "  \"simd\": \"%s\",\n",
+#if defined(__AVX__)
+            "avx"
+#elif defined(__SSE__)
+            "sse"
+#elif defined(__ARM_NEON)
+            "neon"
+#elif defined(__wasm_simd128__)
+            "wasm"
+#else
+            "none"
+#endif
+            );
+    fprintf(fout, "  \"results\": [\n");
+    for (int i = 0; i < (int) g_results.size(); ++i) {
+        const auto & res = g_results[i];
+        fprintf(fout, "    { \"name\": \"%s\", \"params\": \"%s\", \"iterations\": %d, \"mean_us\": %.3f, \"median_us\": %.3f, \"min_us\": %.3f }%s\n",
+                res.name.c_str(), res.params.c_str(), res.iterations, res.mean_us, res.median_us, res.min_us,
+                i + 1 < (int) g_results.size() ? "," : "");
+    }
+    fprintf(fout, "  ]\n");
+    fprintf(fout, "}\n");
+}
+
+}
+
+int main(int argc, char ** argv) {
+    const char * fnameOut = "wave-share-bench.json";
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-q") == 0) {
+            g_minTime_ms = 0.0;
+            g_minRepetitions = 1;
+        } else {
+            fnameOut = argv[i];
+        }
+    }
+
+    FILE * fout = fopen(fnameOut, "w");
+    if (fout == nullptr) {
+        fprintf(stderr, "Failed to open '%s' for writing\n", fnameOut);
+        return 1;
+    }
+
+    benchFFT();
+    benchMixTones();
+    benchInit();
+    benchSend();
+    benchReedSolomon();
+    benchReceive();
+    benchIdle();
+    checkFixedLength();
+
+    writeJSON(fout);
+    fclose(fout);
+
+    fprintf(stderr, "Results written to '%s'\n", fnameOut);
+
+    if (g_nFailedChecks > 0) {
+        fprintf(stderr, "%d correctness checks failed\n", g_nFailedChecks);
+        return 1;
+    }
+
+    return 0;
+}
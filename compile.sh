@@ -2,11 +2,13 @@
 
 echo "static const char * BUILD_TIMESTAMP=\"`date`\";" > build_timestamp.h
 
-em++ -Wall -Wextra -O3 -std=c++11 -s USE_SDL=2 -s WASM=1 ./main.cpp -o wave.js \
+em++ -Wall -Wextra -O3 -std=c++11 -s USE_SDL=2 -s WASM=1 -s ALLOW_MEMORY_GROWTH=1 ./main.cpp ./wave-share.cpp -o wave.js \
     -s EXPORTED_FUNCTIONS='["_getText", "_getSampleRate", "_setText", "_getAverageRxTime_ms", "_setParameters",
                             "_getFramesLeftToRecord", "_getFramesToRecord",
                             "_getFramesLeftToAnalyze", "_getFramesToAnalyze",
                             "_hasDeviceOutput", "_hasDeviceCapture", "_doInit",
-                            "_setTxMode",
+                            "_setTxMode", "_setModulation", "_setRxMode", "_setSlidingHop", "_getWakeupsPerSecond",
+                            "_getRxStages", "_getRxStageName", "_getRxStageCount", "_getRxStageTotal_ms", "_getRxStageMax_ms",
+                            "_getRxStageHistogram", "_resetRxStageStats",
                             "_main"]' \
     -s EXTRA_EXPORTED_RUNTIME_METHODS='["ccall", "cwrap", "writeArrayToMemory"]'
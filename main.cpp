@@ -3,24 +3,20 @@
  *  \author Georgi Gerganov
  */
 
-#include "reed-solomon/rs.hpp"
+#include "wave-share.h"
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_audio.h>
 
-#include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <cctype>
 #include <array>
 #include <string>
 #include <chrono>
-#include <ctime>
 #include <algorithm>
 #include <map>
-#include <complex>
-
-#ifndef M_PI
-#define M_PI 3.14159265358979323846f
-#endif
+#include <vector>
 
 #ifdef __EMSCRIPTEN__
 #include "build_timestamp.h"
@@ -39,736 +35,62 @@ static int g_captureId = -1;
 static int g_playbackId = -1;
 
 static bool g_isInitialized = false;
-static int g_totalBytesCaptured = 0;
+static bool g_txStreaming = false;
+static bool g_printRxStats = false;
+static int g_sampleSizeBytes = 4;
 
 static SDL_AudioDeviceID devid_in = 0;
 static SDL_AudioDeviceID devid_out = 0;
 
-struct DataRxTx;
-static DataRxTx *g_data = nullptr;
-
-namespace {
-
-constexpr double kBaseSampleRate = 48000.0;
-constexpr auto kMaxSamplesPerFrame = 1024;
-constexpr auto kMaxDataBits = 256;
-constexpr auto kMaxDataSize = 256;
-constexpr auto kMaxLength = 140;
-constexpr auto kMaxSpectrumHistory = 4;
-constexpr auto kMaxRecordedFrames = 64*10;
-constexpr auto kDefaultFixedLength = 82;
-
-// FFT routines taken from https://stackoverflow.com/a/37729648/4039976
-
-int log2(int N) {
-    int k = N, i = 0;
-    while(k) {
-        k >>= 1;
-        i++;
-    }
-    return i - 1;
-}
-
-int check(int n) {
-    return n > 0 && (n & (n - 1)) == 0;
-}
-
-int reverse(int N, int n) {
-    int j, p = 0;
-    for(j = 1; j <= log2(N); j++) {
-        if(n & (1 << (log2(N) - j)))
-            p |= 1 << (j - 1);
-    }
-    return p;
-}
-
-void ordina(std::complex<float>* f1, int N) {
-    std::complex<float> f2[kMaxSamplesPerFrame];
-    for(int i = 0; i < N; i++)
-        f2[i] = f1[reverse(N, i)];
-    for(int j = 0; j < N; j++)
-        f1[j] = f2[j];
-}
-
-void transform(std::complex<float>* f, int N) {
-    ordina(f, N);    //first: reverse order
-    std::complex<float> *W;
-    W = (std::complex<float> *)malloc(N / 2 * sizeof(std::complex<float>));
-    W[1] = std::polar(1., -2. * M_PI / N);
-    W[0] = 1;
-    for(int i = 2; i < N / 2; i++)
-        W[i] = pow(W[1], i);
-    int n = 1;
-    int a = N / 2;
-    for(int j = 0; j < log2(N); j++) {
-        for(int i = 0; i < N; i++) {
-            if(!(i & n)) {
-                std::complex<float> temp = f[i];
-                std::complex<float> Temp = W[(i * a) % (n * a)] * f[i + n];
-                f[i] = temp + Temp;
-                f[i + n] = temp - Temp;
-            }
-        }
-        n *= 2;
-        a = a / 2;
-    }
-    free(W);
-}
+static Encoder *g_encoder = nullptr;
+static Decoder *g_decoder = nullptr;
 
-void FFT(std::complex<float>* f, int N, float d) {
-    transform(f, N);
-    for(int i = 0; i < N; i++)
-        f[i] *= d; //multiplying by step
-}
+// Main loop scheduling - the audio callbacks and setText() post to g_wakeup when there is
+// something to do, and update() leaves in g_waitTimeout_ms how long the loop may sleep until
+// it has to check on a timed state (playback draining, the post-Tx guard). The native loop
+// blocks in between instead of polling.
+constexpr auto kMaxWaitTimeout_ms = 1000;
 
-void FFT(float * src, std::complex<float>* dst, int N, float d) {
-    for (int i = 0; i < N; ++i) {
-        dst[i].real(src[i]);
-        dst[i].imag(0);
-    }
-    FFT(dst, N, d);
-}
+static SDL_sem *g_wakeup = nullptr;
+static int g_waitTimeout_ms = 0;
+static int g_nWakeups = 0;
+static float g_wakeupsPerSecond = 0.0f;
 
-enum TxMode {
-    FixedLength = 0,
-    VariableLength,
-};
-
-using AmplitudeData   = std::array<float, kMaxSamplesPerFrame>;
-using AmplitudeData16 = std::array<int16_t, kMaxRecordedFrames*kMaxSamplesPerFrame>;
-using SpectrumData    = std::array<float, kMaxSamplesPerFrame>;
-using RecordedData    = std::array<float, kMaxRecordedFrames*kMaxSamplesPerFrame>;
-
-inline void addAmplitudeSmooth(const AmplitudeData & src, AmplitudeData & dst, float scalar, int startId, int finalId, int cycleMod, int nPerCycle) {
-    int nTotal = nPerCycle*finalId;
-    float frac = 0.15f;
-    float ds = frac*nTotal;
-    float ids = 1.0f/ds;
-    int nBegin = frac*nTotal;
-    int nEnd = (1.0f - frac)*nTotal;
-    for (int i = startId; i < finalId; i++) {
-        float k = cycleMod*finalId + i;
-        if (k < nBegin) {
-            dst[i] += scalar*src[i]*(k*ids);
-        } else if (k > nEnd) {
-            dst[i] += scalar*src[i]*(((float)(nTotal) - k)*ids);
-        } else {
-            dst[i] += scalar*src[i];
-        }
-    }
+static void wakeup() {
+    if (g_wakeup) SDL_SemPost(g_wakeup);
 }
 
+namespace {
 template <class T>
 float getTime_ms(const T & tStart, const T & tEnd) {
     return ((float)(std::chrono::duration_cast<std::chrono::microseconds>(tEnd - tStart).count()))/1000.0;
 }
 
-int getECCBytesForLength(int len) {
-    return std::max(4, 2*(len/5));
+// the progress messages of the encoder and the decoder go to stdout
+void logMessage(const char * message, void * /*userData*/) {
+    printf("%s\n", message);
 }
 }
 
-struct DataRxTx {
-    DataRxTx(int aSampleRateOut, int aSampleRate, int aSamplesPerFrame, int aSampleSizeB, const char * text) {
-        sampleSizeBytes = aSampleSizeB;
-        sampleRate = aSampleRate;
-        sampleRateOut = aSampleRateOut;
-        samplesPerFrame = aSamplesPerFrame;
-
-        init(strlen(text), text);
+void playbackCallback(void * /*userdata*/, Uint8 * stream, int len) {
+    int16_t * dst = reinterpret_cast<int16_t *>(stream);
+    if (g_encoder == nullptr) {
+        std::fill(dst, dst + len/2, 0);
+        return;
     }
-
-    void init(int textLength, const char * stext) {
-        if (textLength > ::kMaxLength) {
-            printf("Truncating data from %d to 140 bytes\n", textLength);
-            textLength = ::kMaxLength;
-        }
-
-        const uint8_t * text = reinterpret_cast<const uint8_t *>(stext);
-        frameId = 0;
-        nIterations = 0;
-        hasData = false;
-
-        isamplesPerFrame = 1.0f/samplesPerFrame;
-        sendVolume = ((double)(paramVolume))/100.0f;
-        hzPerFrame = sampleRate/samplesPerFrame;
-        ihzPerFrame = 1.0/hzPerFrame;
-        framesPerTx = paramFramesPerTx;
-
-        nDataBitsPerTx = paramBytesPerTx*8;
-        nECCBytesPerTx = (txMode == ::TxMode::FixedLength) ? paramECCBytesPerTx : getECCBytesForLength(textLength);
-
-        framesToAnalyze = 0;
-        framesLeftToAnalyze = 0;
-        framesToRecord = 0;
-        framesLeftToRecord = 0;
-        nBitsInMarker = 16;
-        nMarkerFrames = 16;
-        nPostMarkerFrames = 0;
-        sendDataLength = (txMode == ::TxMode::FixedLength) ? ::kDefaultFixedLength : textLength + 3;
-
-        d0 = paramFreqDelta/2;
-        freqDelta_hz = hzPerFrame*paramFreqDelta;
-        freqStart_hz = hzPerFrame*paramFreqStart;
-        if (paramFreqDelta == 1) {
-            d0 = 1;
-            freqDelta_hz *= 2;
-        }
-
-        outputBlock.fill(0);
-        encodedData.fill(0);
-
-        for (int k = 0; k < (int) phaseOffsets.size(); ++k) {
-            phaseOffsets[k] = (M_PI*k)/(nDataBitsPerTx);
-        }
-#ifdef __EMSCRIPTEN__
-        std::random_shuffle(phaseOffsets.begin(), phaseOffsets.end());
-#endif
-
-        for (int k = 0; k < (int) dataBits.size(); ++k) {
-            double freq = freqStart_hz + freqDelta_hz*k;
-            dataFreqs_hz[k] = freq;
-
-            double phaseOffset = phaseOffsets[k];
-            double curHzPerFrame = sampleRateOut/samplesPerFrame;
-            double curIHzPerFrame = 1.0/curHzPerFrame;
-            for (int i = 0; i < samplesPerFrame; i++) {
-                double curi = i;
-                bit1Amplitude[k][i] = std::sin((2.0*M_PI)*(curi*isamplesPerFrame)*(freq*curIHzPerFrame) + phaseOffset);
-            }
-            for (int i = 0; i < samplesPerFrame; i++) {
-                double curi = i;
-                bit0Amplitude[k][i] = std::sin((2.0*M_PI)*(curi*isamplesPerFrame)*((freq + hzPerFrame*d0)*curIHzPerFrame) + phaseOffset);
-            }
-        }
-
-        if (rsData) delete rsData;
-        if (rsLength) delete rsLength;
-
-        if (txMode == ::TxMode::FixedLength) {
-            rsData = new RS::ReedSolomon(kDefaultFixedLength, nECCBytesPerTx);
-        } else {
-            rsData = new RS::ReedSolomon(textLength, nECCBytesPerTx);
-            rsLength = new RS::ReedSolomon(1, 2);
-        }
-
-        if (textLength > 0) {
-            static std::array<char, ::kMaxDataSize> theData;
-            theData.fill(0);
-
-            if (txMode == ::TxMode::FixedLength) {
-                for (int i = 0; i < textLength; ++i) theData[i] = text[i];
-                rsData->Encode(theData.data(), encodedData.data());
-            } else {
-                theData[0] = textLength;
-                for (int i = 0; i < textLength; ++i) theData[i + 1] = text[i];
-                rsData->Encode(theData.data() + 1, encodedData.data() + 3);
-                rsLength->Encode(theData.data(), encodedData.data());
-            }
-
-            hasData = true;
-        }
-
-        // Rx
-        receivingData = false;
-        analyzingData = false;
-
-        sampleAmplitude.fill(0);
-
-        sampleSpectrum.fill(0);
-        for (auto & s : sampleAmplitudeHistory) {
-            s.fill(0);
-        }
-
-        rxData.fill(0);
-
-        for (int i = 0; i < samplesPerFrame; ++i) {
-            fftOut[i].real(0.0f);
-            fftOut[i].imag(0.0f);
-        }
+    bool wasStreaming = g_encoder->isStreaming();
+    g_encoder->streamFrames(dst, len/2);
+    if (wasStreaming && g_encoder->isStreaming() == false) {
+        wakeup();
     }
+}
 
-    void send() {
-        int samplesPerFrameOut = (sampleRateOut/sampleRate)*samplesPerFrame;
-        if (sampleRateOut != sampleRate) {
-            printf("Resampling from %d Hz to %d Hz\n", (int) sampleRate, (int) sampleRateOut);
-        }
-
-        while(hasData) {
-            int nBytesPerTx = nDataBitsPerTx/8;
-            std::fill(outputBlock.begin(), outputBlock.end(), 0.0f);
-            std::uint16_t nFreq = 0;
-
-            if (sampleRateOut != sampleRate) {
-                for (int k = 0; k < nDataBitsPerTx; ++k) {
-                    double freq = freqStart_hz + freqDelta_hz*k;
-
-                    double phaseOffset = phaseOffsets[k];
-                    double curHzPerFrame = sampleRateOut/samplesPerFrame;
-                    double curIHzPerFrame = 1.0/curHzPerFrame;
-                    for (int i = 0; i < samplesPerFrameOut; i++) {
-                        double curi = (i + frameId*samplesPerFrameOut);
-                        bit1Amplitude[k][i] = std::sin((2.0*M_PI)*(curi*isamplesPerFrame)*(freq*curIHzPerFrame) + phaseOffset);
-                    }
-                    for (int i = 0; i < samplesPerFrameOut; i++) {
-                        double curi = (i + frameId*samplesPerFrameOut);
-                        bit0Amplitude[k][i] = std::sin((2.0*M_PI)*(curi*isamplesPerFrame)*((freq + hzPerFrame*d0)*curIHzPerFrame) + phaseOffset);
-                    }
-                }
-            }
-
-            if (frameId < nMarkerFrames) {
-                nFreq = nBitsInMarker;
-
-                for (int i = 0; i < nBitsInMarker; ++i) {
-                    if (i%2 == 0) {
-                        ::addAmplitudeSmooth(bit1Amplitude[i], outputBlock, sendVolume, 0, samplesPerFrameOut, frameId, nMarkerFrames);
-                    } else {
-                        ::addAmplitudeSmooth(bit0Amplitude[i], outputBlock, sendVolume, 0, samplesPerFrameOut, frameId, nMarkerFrames);
-                    }
-                }
-            } else if (frameId < nMarkerFrames + nPostMarkerFrames) {
-                nFreq = nBitsInMarker;
-
-                for (int i = 0; i < nBitsInMarker; ++i) {
-                    if (i%2 == 0) {
-                        ::addAmplitudeSmooth(bit0Amplitude[i], outputBlock, sendVolume, 0, samplesPerFrameOut, frameId - nMarkerFrames, nPostMarkerFrames);
-                    } else {
-                        ::addAmplitudeSmooth(bit1Amplitude[i], outputBlock, sendVolume, 0, samplesPerFrameOut, frameId - nMarkerFrames, nPostMarkerFrames);
-                    }
-                }
-            } else if (frameId <
-                       (nMarkerFrames + nPostMarkerFrames) +
-                       ((sendDataLength + nECCBytesPerTx)/nBytesPerTx + 2)*framesPerTx) {
-                int dataOffset = frameId - nMarkerFrames - nPostMarkerFrames;
-                int cycleModMain = dataOffset%framesPerTx;
-                dataOffset /= framesPerTx;
-                dataOffset *= nBytesPerTx;
-
-                dataBits.fill(0);
-
-                if (paramFreqDelta > 1) {
-                    for (int j = 0; j < nBytesPerTx; ++j) {
-                        for (int i = 0; i < 8; ++i) {
-                            dataBits[j*8 + i] = encodedData[dataOffset + j] & (1 << i);
-                        }
-                    }
-
-                    for (int k = 0; k < nDataBitsPerTx; ++k) {
-                        ++nFreq;
-                        if (dataBits[k] == false) {
-                            ::addAmplitudeSmooth(bit0Amplitude[k], outputBlock, sendVolume, 0, samplesPerFrameOut, cycleModMain, framesPerTx);
-                            continue;
-                        }
-                        ::addAmplitudeSmooth(bit1Amplitude[k], outputBlock, sendVolume, 0, samplesPerFrameOut, cycleModMain, framesPerTx);
-                    }
-                } else {
-                    for (int j = 0; j < nBytesPerTx; ++j) {
-                        {
-                            uint8_t d = encodedData[dataOffset + j] & 15;
-                            dataBits[(2*j + 0)*16 + d] = 1;
-                        }
-                        {
-                            uint8_t d = encodedData[dataOffset + j] & 240;
-                            dataBits[(2*j + 1)*16 + (d >> 4)] = 1;
-                        }
-                    }
-
-                    for (int k = 0; k < 2*nBytesPerTx*16; ++k) {
-                        if (dataBits[k] == 0) continue;
-
-                        ++nFreq;
-                        if (k%2) {
-                            ::addAmplitudeSmooth(bit0Amplitude[k/2], outputBlock, sendVolume, 0, samplesPerFrameOut, cycleModMain, framesPerTx);
-                        } else {
-                            ::addAmplitudeSmooth(bit1Amplitude[k/2], outputBlock, sendVolume, 0, samplesPerFrameOut, cycleModMain, framesPerTx);
-                        }
-                    }
-                }
-            } else if (txMode == ::TxMode::VariableLength && frameId <
-                       (nMarkerFrames + nPostMarkerFrames) +
-                       ((sendDataLength + nECCBytesPerTx)/nBytesPerTx + 2)*framesPerTx +
-                       (nMarkerFrames)) {
-                nFreq = nBitsInMarker;
-
-                int fId = frameId - ((nMarkerFrames + nPostMarkerFrames) + ((sendDataLength + nECCBytesPerTx)/nBytesPerTx + 2)*framesPerTx);
-                for (int i = 0; i < nBitsInMarker; ++i) {
-                    if (i%2 == 0) {
-                        ::addAmplitudeSmooth(bit0Amplitude[i], outputBlock, sendVolume, 0, samplesPerFrameOut, fId, nMarkerFrames);
-                    } else {
-                        ::addAmplitudeSmooth(bit1Amplitude[i], outputBlock, sendVolume, 0, samplesPerFrameOut, fId, nMarkerFrames);
-                    }
-                }
-            } else {
-                textToSend = "";
-                hasData = false;
-            }
-
-            if (nFreq == 0) nFreq = 1;
-            float scale = 1.0f/nFreq;
-            for (int i = 0; i < samplesPerFrameOut; ++i) {
-                outputBlock[i] *= scale;
-            }
-
-            for (int i = 0; i < samplesPerFrameOut; ++i) {
-                outputBlock16[frameId*samplesPerFrameOut + i] = std::round(32000.0*outputBlock[i]);
-            }
-            ++frameId;
-        }
-        SDL_QueueAudio(devid_out, outputBlock16.data(), 2*frameId*samplesPerFrameOut);
-    }
-
-    void receive() {
-        static int nCalls = 0;
-        static float tSum_ms = 0.0f;
-        auto tCallStart = std::chrono::high_resolution_clock::now();
-
-        if (needUpdate) {
-            init(0, "");
-            needUpdate = false;
-        }
-
-        while (hasData == false) {
-            // read capture data
-            int nBytesRecorded = SDL_DequeueAudio(devid_in, sampleAmplitude.data(), samplesPerFrame*sampleSizeBytes);
-            if (nBytesRecorded != 0) {
-                {
-                    sampleAmplitudeHistory[historyId] = sampleAmplitude;
-
-                    if (++historyId >= ::kMaxSpectrumHistory) {
-                        historyId = 0;
-                    }
-
-                    if (historyId == 0 && (receivingData == false || (receivingData && txMode == ::TxMode::VariableLength))) {
-                        std::fill(sampleAmplitudeAverage.begin(), sampleAmplitudeAverage.end(), 0.0f);
-                        for (auto & s : sampleAmplitudeHistory) {
-                            for (int i = 0; i < samplesPerFrame; ++i) {
-                                sampleAmplitudeAverage[i] += s[i];
-                            }
-                        }
-                        float norm = 1.0f/::kMaxSpectrumHistory;
-                        for (int i = 0; i < samplesPerFrame; ++i) {
-                            sampleAmplitudeAverage[i] *= norm;
-                        }
-
-                        // calculate spectrum
-                        std::copy(sampleAmplitudeAverage.begin(), sampleAmplitudeAverage.begin() + samplesPerFrame, fftIn.data());
-
-                        FFT(fftIn.data(), fftOut.data(), samplesPerFrame, 1.0);
-
-                        double fsum = 0.0;
-                        for (int i = 0; i < samplesPerFrame; ++i) {
-                            sampleSpectrum[i] = (fftOut[i].real()*fftOut[i].real() + fftOut[i].imag()*fftOut[i].imag());
-                            fsum += sampleSpectrum[i];
-                        }
-                        for (int i = 1; i < samplesPerFrame/2; ++i) {
-                            sampleSpectrum[i] += sampleSpectrum[samplesPerFrame - i];
-                        }
-
-                        if (fsum < 1e-10) {
-                            g_totalBytesCaptured = 0;
-                        } else {
-                            g_totalBytesCaptured += nBytesRecorded;
-                        }
-                    }
-
-                    if (framesLeftToRecord > 0) {
-                        std::copy(sampleAmplitude.begin(),
-                                  sampleAmplitude.begin() + samplesPerFrame,
-                                  recordedAmplitude.data() + (framesToRecord - framesLeftToRecord)*samplesPerFrame);
-
-                        if (--framesLeftToRecord <= 0) {
-                            std::fill(sampleSpectrum.begin(), sampleSpectrum.end(), 0.0f);
-                            analyzingData = true;
-                        }
-                    }
-                }
-
-                if (analyzingData) {
-                    int nBytesPerTx = nDataBitsPerTx/8;
-                    int stepsPerFrame = 16;
-                    int step = samplesPerFrame/stepsPerFrame;
-
-                    int offsetStart = 0;
-
-                    framesToAnalyze = nMarkerFrames*stepsPerFrame;
-                    framesLeftToAnalyze = framesToAnalyze;
-
-                    bool isValid = false;
-                    //for (int ii = nMarkerFrames*stepsPerFrame/2; ii < (nMarkerFrames + nPostMarkerFrames)*stepsPerFrame; ++ii) {
-                    for (int ii = nMarkerFrames*stepsPerFrame - 1; ii >= nMarkerFrames*stepsPerFrame/2; --ii) {
-                        offsetStart = ii;
-                        bool knownLength = txMode == ::TxMode::FixedLength;
-                        int encodedOffset = (txMode == ::TxMode::FixedLength) ? 0 : 3;
-
-                        for (int itx = 0; itx < 1024; ++itx) {
-                            int offsetTx = offsetStart + itx*framesPerTx*stepsPerFrame;
-                            if (offsetTx >= recvDuration_frames*stepsPerFrame) {
-                                break;
-                            }
-
-                            std::copy(
-                                recordedAmplitude.begin() + offsetTx*step,
-                                recordedAmplitude.begin() + offsetTx*step + samplesPerFrame, fftIn.data());
-
-                            for (int k = 1; k < framesPerTx-1; ++k) {
-                                for (int i = 0; i < samplesPerFrame; ++i) {
-                                    fftIn[i] += recordedAmplitude[(offsetTx + k*stepsPerFrame)*step + i];
-                                }
-                            }
-
-                            FFT(fftIn.data(), fftOut.data(), samplesPerFrame, 1.0);
-
-                            for (int i = 0; i < samplesPerFrame; ++i) {
-                                sampleSpectrum[i] = (fftOut[i].real()*fftOut[i].real() + fftOut[i].imag()*fftOut[i].imag());
-                            }
-                            for (int i = 1; i < samplesPerFrame/2; ++i) {
-                                sampleSpectrum[i] += sampleSpectrum[samplesPerFrame - i];
-                            }
-
-                            uint8_t curByte = 0;
-                            if (paramFreqDelta > 1) {
-                                for (int i = 0; i < nDataBitsPerTx; ++i) {
-                                    int k = i%8;
-                                    int bin = std::round(dataFreqs_hz[i]*ihzPerFrame);
-                                    if (sampleSpectrum[bin] > 1*sampleSpectrum[bin + d0]) {
-                                        curByte += 1 << k;
-                                    } else if (sampleSpectrum[bin + d0] > 1*sampleSpectrum[bin]) {
-                                    } else {
-                                    }
-                                    if (k == 7) {
-                                        encodedData[itx*nBytesPerTx + i/8] = curByte;
-                                        curByte = 0;
-                                    }
-                                }
-                            } else {
-                                for (int i = 0; i < 2*nBytesPerTx; ++i) {
-                                    int bin = std::round(dataFreqs_hz[0]*ihzPerFrame) + i*16;
-
-                                    int kmax = 0;
-                                    double amax = 0.0;
-                                    for (int k = 0; k < 16; ++k) {
-                                        if (sampleSpectrum[bin + k] > amax) {
-                                            kmax = k;
-                                            amax = sampleSpectrum[bin + k];
-                                        }
-                                    }
-
-                                    if (i%2) {
-                                        curByte += (kmax << 4);
-                                        encodedData[itx*nBytesPerTx + i/2] = curByte;
-                                        curByte = 0;
-                                    } else {
-                                        curByte = kmax;
-                                    }
-                                }
-                            }
-
-                            if (txMode == ::TxMode::VariableLength) {
-                                if (itx*nBytesPerTx > 3 && knownLength == false) {
-                                    if ((rsLength->Decode(encodedData.data(), rxData.data()) == 0) && (rxData[0] <= 140)) {
-                                        knownLength = true;
-                                    } else {
-                                        break;
-                                    }
-                                }
-                            }
-                        }
-
-                        if (txMode == ::TxMode::VariableLength && knownLength) {
-                            if (rsData) delete rsData;
-                            rsData = new RS::ReedSolomon(rxData[0], ::getECCBytesForLength(rxData[0]));
-                        }
-
-                        if (knownLength) {
-                            int decodedLength = rxData[0];
-                            if (rsData->Decode(encodedData.data() + encodedOffset, rxData.data()) == 0) {
-                                printf("Decoded length = %d\n", decodedLength);
-                                if (txMode == ::TxMode::FixedLength && rxData[0] == 'A') {
-                                    printf("[ANSWER] Received sound data successfully!\n");
-                                } else if (txMode == ::TxMode::FixedLength && rxData[0] == 'O') {
-                                    printf("[OFFER]  Received sound data successfully!\n");
-                                } else {
-                                    std::string s((char *) rxData.data(), decodedLength);
-                                    printf("Received sound data successfully: '%s'\n", s.c_str());
-                                }
-                                framesToRecord = 0;
-                                isValid = true;
-                            }
-                        }
-
-                        if (isValid) {
-                            break;
-                        }
-                        --framesLeftToAnalyze;
-                    }
-
-                    if (isValid == false) {
-                        printf("Failed to capture sound data. Please try again\n");
-                        framesToRecord = -1;
-                    }
-
-                    receivingData = false;
-                    analyzingData = false;
-
-                    std::fill(sampleSpectrum.begin(), sampleSpectrum.end(), 0.0f);
-
-                    framesToAnalyze = 0;
-                    framesLeftToAnalyze = 0;
-                }
-
-                // check if receiving data
-                if (receivingData == false) {
-                    bool isReceiving = true;
-
-                    for (int i = 0; i < nBitsInMarker; ++i) {
-                        int bin = std::round(dataFreqs_hz[i]*ihzPerFrame);
-
-                        if (i%2 == 0) {
-                            if (sampleSpectrum[bin] <= 3.0f*sampleSpectrum[bin + d0]) isReceiving = false;
-                        } else {
-                            if (sampleSpectrum[bin] >= 3.0f*sampleSpectrum[bin + d0]) isReceiving = false;
-                        }
-                    }
-
-                    if (isReceiving) {
-                        std::time_t timestamp = std::time(nullptr);
-                        printf("%sReceiving sound data ...\n", std::asctime(std::localtime(&timestamp)));
-                        rxData.fill(0);
-                        receivingData = true;
-                        if (txMode == ::TxMode::FixedLength) {
-                            recvDuration_frames = nMarkerFrames + nPostMarkerFrames + framesPerTx*((::kDefaultFixedLength + paramECCBytesPerTx)/paramBytesPerTx + 1);
-                        } else {
-                            recvDuration_frames = nMarkerFrames + nPostMarkerFrames + framesPerTx*((::kMaxLength + ::getECCBytesForLength(::kMaxLength))/paramBytesPerTx + 1);
-                        }
-                        framesToRecord = recvDuration_frames;
-                        framesLeftToRecord = recvDuration_frames;
-                    }
-                } else if (txMode == ::TxMode::VariableLength) {
-                    bool isEnded = true;
-
-                    for (int i = 0; i < nBitsInMarker; ++i) {
-                        int bin = std::round(dataFreqs_hz[i]*ihzPerFrame);
-
-                        if (i%2 == 0) {
-                            if (sampleSpectrum[bin] >= 3.0f*sampleSpectrum[bin + d0]) isEnded = false;
-                        } else {
-                            if (sampleSpectrum[bin] <= 3.0f*sampleSpectrum[bin + d0]) isEnded = false;
-                        }
-                    }
-
-                    if (isEnded && framesToRecord > 1) {
-                        std::time_t timestamp = std::time(nullptr);
-                        printf("%sReceived end marker\n", std::asctime(std::localtime(&timestamp)));
-                        recvDuration_frames -= framesLeftToRecord - 1;
-                        framesLeftToRecord = 1;
-                    }
-                }
-            } else {
-                break;
-            }
-
-            ++nIterations;
-        }
-
-        auto tCallEnd = std::chrono::high_resolution_clock::now();
-        tSum_ms += getTime_ms(tCallStart, tCallEnd);
-        if (++nCalls == 10) {
-            averageRxTime_ms = tSum_ms/nCalls;
-            tSum_ms = 0.0f;
-            nCalls = 0;
-        }
-
-        if ((int) SDL_GetQueuedAudioSize(devid_in) > 32*sampleSizeBytes*samplesPerFrame) {
-            printf("nIter = %d, Queue size: %d\n", nIterations, SDL_GetQueuedAudioSize(devid_in));
-            SDL_ClearQueuedAudio(devid_in);
-        }
-    }
-
-    int nIterations;
-    bool needUpdate = false;
-
-    int paramFreqDelta = 6;
-    int paramFreqStart = 40;
-    int paramFramesPerTx = 6;
-    int paramBytesPerTx = 2;
-    int paramECCBytesPerTx = 32;
-    int paramVolume = 10;
-
-    // Rx
-    bool receivingData;
-    bool analyzingData;
-
-    std::array<float, kMaxSamplesPerFrame> fftIn;
-    std::array<std::complex<float>, kMaxSamplesPerFrame> fftOut;
-
-    ::AmplitudeData sampleAmplitude;
-    ::SpectrumData sampleSpectrum;
-
-    std::array<std::uint8_t, ::kMaxDataSize> rxData;
-    std::array<std::uint8_t, ::kMaxDataSize> encodedData;
-
-    int historyId = 0;
-    ::AmplitudeData sampleAmplitudeAverage;
-    std::array<::AmplitudeData, ::kMaxSpectrumHistory> sampleAmplitudeHistory;
-
-    ::RecordedData recordedAmplitude;
-
-    // Tx
-    bool hasData;
-    int sampleSizeBytes;
-    float sampleRate;
-    float sampleRateOut;
-    int samplesPerFrame;
-    float isamplesPerFrame;
-
-    ::AmplitudeData outputBlock;
-    ::AmplitudeData16 outputBlock16;
-
-    std::array<::AmplitudeData, ::kMaxDataBits> bit1Amplitude;
-    std::array<::AmplitudeData, ::kMaxDataBits> bit0Amplitude;
-
-    float sendVolume;
-    float hzPerFrame;
-    float ihzPerFrame;
-
-    int d0 = 1;
-    float freqStart_hz;
-    float freqDelta_hz;
-
-    int frameId;
-    int nRampFrames;
-    int nRampFramesBegin;
-    int nRampFramesEnd;
-    int nRampFramesBlend;
-    int dataId;
-    int framesPerTx;
-    int framesToAnalyze;
-    int framesLeftToAnalyze;
-    int framesToRecord;
-    int framesLeftToRecord;
-    int nBitsInMarker;
-    int nMarkerFrames;
-    int nPostMarkerFrames;
-    int recvDuration_frames;
-
-    ::TxMode txMode = ::TxMode::FixedLength;
-
-    std::array<bool, ::kMaxDataBits> dataBits;
-    std::array<double, ::kMaxDataBits> phaseOffsets;
-    std::array<double, ::kMaxDataBits> dataFreqs_hz;
-
-    int nDataBitsPerTx;
-    int nECCBytesPerTx;
-    int sendDataLength;
-
-    RS::ReedSolomon * rsData = nullptr;
-    RS::ReedSolomon * rsLength = nullptr;
-
-    float averageRxTime_ms = 0.0;
-
-    std::string textToSend;
-};
+// capture goes straight into the decoder's ring buffer
+void captureCallback(void * /*userdata*/, Uint8 * stream, int len) {
+    if (g_decoder == nullptr) return;
+    g_decoder->push(reinterpret_cast<const float *>(stream), len/sizeof(float));
+    wakeup();
+}
 
 int init() {
     if (g_isInitialized) return 0;
@@ -808,6 +130,12 @@ int init() {
     desiredSpec.samples = 16*1024;
     desiredSpec.callback = NULL;
 
+    if (g_txStreaming) {
+        // frames are rendered on demand, so a one-frame device buffer is enough
+        desiredSpec.samples = ::kMaxSamplesPerFrame;
+        desiredSpec.callback = playbackCallback;
+    }
+
     SDL_AudioSpec obtainedSpec;
     SDL_zero(obtainedSpec);
 
@@ -842,6 +170,7 @@ int init() {
     captureSpec.freq = ::kBaseSampleRate;
     captureSpec.format = AUDIO_F32SYS;
     captureSpec.samples = 1024;
+    captureSpec.callback = captureCallback;
 
     if (g_playbackId >= 0) {
         printf("Attempt to open capture device %d : '%s' ...\n", g_captureId, SDL_GetAudioDeviceName(g_captureId, SDL_FALSE));
@@ -878,7 +207,15 @@ int init() {
     //        break;
     //}
 
-    g_data = new DataRxTx(obtainedSpec.freq, ::kBaseSampleRate, captureSpec.samples, sampleSizeBytes, "");
+    g_sampleSizeBytes = sampleSizeBytes;
+    g_encoder = new Encoder(obtainedSpec.freq, captureSpec.samples);
+    g_decoder = new Decoder(::kBaseSampleRate, captureSpec.samples);
+    g_encoder->setLogCallback(logMessage);
+    g_decoder->setLogCallback(logMessage);
+
+#ifndef __EMSCRIPTEN__
+    g_wakeup = SDL_CreateSemaphore(0);
+#endif
 
     g_isInitialized = true;
     return 0;
@@ -886,26 +223,44 @@ int init() {
 
 // JS interface
 extern "C" {
+    // may be called from any thread - the message is queued and sent after the ones before it
     int setText(int textLength, const char * text) {
-        g_data->init(textLength, text);
+        if (g_encoder->queueText(text, textLength) == false) {
+            if (textLength > 0) printf("Tx queue is full - message dropped\n");
+            return -1;
+        }
+        wakeup();
         return 0;
     }
 
     int getText(char * text) {
-        std::copy(g_data->rxData.begin(), g_data->rxData.end(), text);
+        std::copy(g_decoder->getRxData(), g_decoder->getRxData() + ::kMaxDataSize, text);
         return 0;
     }
 
-    int getSampleRate() { return g_data->sampleRate; }
-    float getAverageRxTime_ms() { return g_data->averageRxTime_ms; }
-    int getFramesToRecord() { return g_data->framesToRecord; }
-    int getFramesLeftToRecord() { return g_data->framesLeftToRecord; }
-    int getFramesToAnalyze() { return g_data->framesToAnalyze; }
-    int getFramesLeftToAnalyze() { return g_data->framesLeftToAnalyze; }
+    int getSampleRate() { return g_decoder->getSampleRate(); }
+    float getAverageRxTime_ms() { return g_decoder->getAverageRxTime_ms(); }
+    int getFramesToRecord() { return g_decoder->getFramesToRecord(); }
+    int getFramesLeftToRecord() { return g_decoder->getFramesLeftToRecord(); }
+    int getFramesToAnalyze() { return g_decoder->getFramesToAnalyze(); }
+    int getFramesLeftToAnalyze() { return g_decoder->getFramesLeftToAnalyze(); }
     int hasDeviceOutput() { return devid_out; }
-    int hasDeviceCapture() { return (g_totalBytesCaptured > 0) ? devid_in : 0; }
+    int hasDeviceCapture() { return g_decoder->hasSignal() ? devid_in : 0; }
     int doInit() { return init(); }
-    int setTxMode(int txMode) { g_data->txMode = (::TxMode)(txMode); return 0; }
+    int setTxMode(int txMode) { g_encoder->setTxMode((::TxMode)(txMode)); g_decoder->setTxMode((::TxMode)(txMode)); return 0; }
+    int setModulation(int modulation) { g_encoder->setModulation((::Modulation)(modulation)); g_decoder->setModulation((::Modulation)(modulation)); return 0; }
+    int setRxMode(int rxMode) { g_decoder->setRxMode((::RxMode)(rxMode)); return 0; }
+    int setSlidingHop(int hop) { g_decoder->setSlidingHop(hop); return 0; }
+    float getWakeupsPerSecond() { return g_wakeupsPerSecond; }
+
+    // latency statistics of the receive stages - see RxStage for the stage ids
+    int getRxStages() { return ::kRxStages; }
+    const char * getRxStageName(int stage) { return Decoder::getRxStageName((::RxStage)(stage)); }
+    int getRxStageCount(int stage) { return g_decoder->getRxStageStats((::RxStage)(stage)).count; }
+    float getRxStageTotal_ms(int stage) { return g_decoder->getRxStageStats((::RxStage)(stage)).total_ms; }
+    float getRxStageMax_ms(int stage) { return g_decoder->getRxStageStats((::RxStage)(stage)).max_ms; }
+    int getRxStageHistogram(int stage, int bin) { return g_decoder->getRxStageStats((::RxStage)(stage)).histogram[bin]; }
+    void resetRxStageStats() { g_decoder->resetRxStageStats(); }
 
     void setParameters(
         int paramFreqDelta,
@@ -914,15 +269,66 @@ extern "C" {
         int paramBytesPerTx,
         int /*paramECCBytesPerTx*/,
         int paramVolume) {
-        if (g_data == nullptr) return;
+        if (g_encoder == nullptr || g_decoder == nullptr) return;
 
-        g_data->paramFreqDelta = paramFreqDelta;
-        g_data->paramFreqStart = paramFreqStart;
-        g_data->paramFramesPerTx = paramFramesPerTx;
-        g_data->paramBytesPerTx = paramBytesPerTx;
-        g_data->paramVolume = paramVolume;
+        g_encoder->setParameters(paramFreqDelta, paramFreqStart, paramFramesPerTx, paramBytesPerTx, paramVolume);
+        g_decoder->setParameters(paramFreqDelta, paramFreqStart, paramFramesPerTx, paramBytesPerTx);
+    }
+}
 
-        g_data->needUpdate = true;
+// queue the whole message for playback
+static void send() {
+    if (g_encoder->getSampleRateOut() != (int) ::kBaseSampleRate) {
+        printf("Resampling from %d Hz to %d Hz\n", (int) ::kBaseSampleRate, g_encoder->getSampleRateOut());
+    }
+
+    static std::array<int16_t, ::kMaxSamplesPerFrame> outputBlock16;
+    while (g_encoder->hasData()) {
+        int nSamples = g_encoder->encodeFrame(outputBlock16.data());
+        SDL_QueueAudio(devid_out, outputBlock16.data(), 2*nSamples);
+    }
+}
+
+static void printRxStageStats() {
+    printf("Receive stage latencies:\n");
+    printf("    %-18s %10s %12s %10s %10s\n", "stage", "calls", "total ms", "mean us", "max us");
+    for (int i = 0; i < ::kRxStages; ++i) {
+        const auto & stats = g_decoder->getRxStageStats((::RxStage)(i));
+        if (stats.count == 0) continue;
+
+        printf("    %-18s %10lld %12.3f %10.2f %10.2f\n", Decoder::getRxStageName((::RxStage)(i)),
+               stats.count, stats.total_ms, 1000.0*stats.total_ms/stats.count, 1000.0*stats.max_ms);
+
+        // histogram - the calls per power-of-two bucket, labeled with the bucket's upper bound
+        printf("        ");
+        for (int k = 0; k < ::kRxStageHistogramBins; ++k) {
+            if (stats.histogram[k] == 0) continue;
+            printf(" <%lldus:%lld", 1ll << k, stats.histogram[k]);
+        }
+        printf("\n");
+    }
+    if (g_wakeup) {
+        printf("    main loop wakeups: %.1f/s\n", g_wakeupsPerSecond);
+    }
+}
+
+// decode the audio captured since the last call
+static void receive() {
+    static long long nAnalysesLast = 0;
+
+    g_decoder->process();
+
+    long long nAnalyses = g_decoder->getRxStageStats(::RxStage::Analysis).count;
+    if (g_printRxStats && nAnalyses != nAnalysesLast) {
+        printRxStageStats();
+    }
+    nAnalysesLast = nAnalyses;
+
+    static long long nDroppedLast = 0;
+    long long nDropped = g_decoder->getSamplesDropped();
+    if (nDropped != nDroppedLast) {
+        printf("Capture buffer overflow: %lld samples dropped\n", nDropped - nDroppedLast);
+        nDroppedLast = nDropped;
     }
 }
 
@@ -930,6 +336,20 @@ extern "C" {
 void update() {
     if (g_isInitialized == false) return;
 
+    {
+        static auto tStart = std::chrono::high_resolution_clock::now();
+        auto tNow = std::chrono::high_resolution_clock::now();
+        float dt_ms = ::getTime_ms(tStart, tNow);
+        ++g_nWakeups;
+        if (dt_ms >= 1000.0f) {
+            g_wakeupsPerSecond = 1000.0f*g_nWakeups/dt_ms;
+            g_nWakeups = 0;
+            tStart = tNow;
+        }
+    }
+
+    g_waitTimeout_ms = kMaxWaitTimeout_ms;
+
     SDL_Event e;
     SDL_bool shouldTerminate = SDL_FALSE;
     while (SDL_PollEvent(&e)) {
@@ -938,29 +358,51 @@ void update() {
         }
     }
 
-    if (g_data->hasData == false) {
+    if (g_txStreaming == false && g_encoder->hasData()) {
+        SDL_PauseAudioDevice(devid_out, SDL_TRUE);
+        SDL_PauseAudioDevice(devid_in, SDL_TRUE);
+
+        send();
+
+        // nothing to do until the queued audio has (almost) been played
+        g_waitTimeout_ms = 0;
+    } else {
         SDL_PauseAudioDevice(devid_out, SDL_FALSE);
 
         static auto tLastNoData = std::chrono::high_resolution_clock::now();
         auto tNow = std::chrono::high_resolution_clock::now();
 
-        if ((int) SDL_GetQueuedAudioSize(devid_out) < g_data->samplesPerFrame*g_data->sampleSizeBytes) {
+        bool isPlaying = false;
+        if (g_txStreaming) {
+            // hand the new message to the audio callback - it renders the frames from here on
+            if (g_encoder->isStreaming() == false && g_encoder->hasData()) {
+                g_encoder->startStreaming();
+            }
+            isPlaying = g_encoder->isStreaming();
+        } else {
+            int nQueued = SDL_GetQueuedAudioSize(devid_out);
+            int nThreshold = g_decoder->getSamplesPerFrame()*g_sampleSizeBytes;
+            isPlaying = nQueued >= nThreshold;
+            if (isPlaying) {
+                // no callback tells us when the queue drains - sleep until it should have
+                int bytesPerSecond = sizeof(int16_t)*g_encoder->getSampleRateOut();
+                g_waitTimeout_ms = std::min(kMaxWaitTimeout_ms, 1 + (int) ((1000ll*(nQueued - nThreshold))/bytesPerSecond));
+            }
+        }
+
+        if (isPlaying == false) {
             SDL_PauseAudioDevice(devid_in, SDL_FALSE);
-            if (::getTime_ms(tLastNoData, tNow) > 500.0f) {
-                g_data->receive();
+            float tSinceTx_ms = ::getTime_ms(tLastNoData, tNow);
+            if (tSinceTx_ms > 500.0f) {
+                receive();
             } else {
-                SDL_ClearQueuedAudio(devid_in);
+                g_decoder->skip();
+                g_waitTimeout_ms = std::min(g_waitTimeout_ms, 1 + (int) (500.0f - tSinceTx_ms));
             }
         } else {
+            SDL_PauseAudioDevice(devid_in, SDL_TRUE);
             tLastNoData = tNow;
-            //SDL_ClearQueuedAudio(devid_in);
-            //SDL_Delay(10);
         }
-    } else {
-        SDL_PauseAudioDevice(devid_out, SDL_TRUE);
-        SDL_PauseAudioDevice(devid_in, SDL_TRUE);
-
-        g_data->send();
     }
 
     if (shouldTerminate) {
@@ -990,37 +432,157 @@ static std::map<std::string, std::string> parseCmdArguments(int argc, char ** ar
     return res;
 }
 
-int main(int argc, char** argv) {
-#ifdef __EMSCRIPTEN__
-    printf("Build time: %s\n", BUILD_TIMESTAMP);
-    printf("Press the Init button to start\n");
+#ifndef __EMSCRIPTEN__
+static bool hasExtension(const std::string & fname, const std::string & ext) {
+    if (fname.size() < ext.size()) return false;
+    return std::equal(ext.rbegin(), ext.rend(), fname.rbegin(), [](char a, char b) { return a == std::tolower(b); });
+}
 
-    g_captureDeviceName = argv[1];
-#else
-    printf("Usage: %s [-cN] [-pN] [-tN]\n", argv[0]);
-    printf("    -cN - select capture device N\n");
-    printf("    -pN - select playback device N\n");
-    printf("    -tN - transmission protocol:\n");
-    printf("          -t0 : Normal\n");
-    printf("          -t1 : Fast (default)\n");
-    printf("          -t2 : Fastest\n");
-    printf("          -t3 : Ultrasonic\n");
-    printf("\n");
+// Load mono float samples at kBaseSampleRate from a WAV file (16-bit PCM or 32-bit float, first channel
+// is used, other sample rates are resampled linearly) or from raw 16-bit PCM at kBaseSampleRate
+static bool readAudioFile(const std::string & fname, std::vector<float> & samples) {
+    FILE * fin = fopen(fname.c_str(), "rb");
+    if (fin == nullptr) {
+        printf("Failed to open '%s' for reading\n", fname.c_str());
+        return false;
+    }
 
-    g_captureDeviceName = nullptr;
+    std::vector<uint8_t> bytes;
+    {
+        std::array<uint8_t, 64*1024> buf;
+        size_t n = 0;
+        while ((n = fread(buf.data(), 1, buf.size(), fin)) > 0) {
+            bytes.insert(bytes.end(), buf.begin(), buf.begin() + n);
+        }
+        fclose(fin);
+    }
 
-    auto argm = parseCmdArguments(argc, argv);
-    g_captureId = argm["c"].empty() ? 0 : std::stoi(argm["c"]);
-    g_playbackId = argm["p"].empty() ? 0 : std::stoi(argm["p"]);
-    int txProtocol = argm["t"].empty() ? 1 : std::stoi(argm["t"]);
-#endif
+    auto u16 = [&](size_t p) { return (uint32_t) bytes[p] | ((uint32_t) bytes[p + 1] << 8); };
+    auto u32 = [&](size_t p) { return u16(p) | (u16(p + 2) << 16); };
 
-#ifdef __EMSCRIPTEN__
-    emscripten_set_main_loop(update, 60, 1);
-#else
-    init();
-    setTxMode(1);
+    samples.clear();
+
+    if (hasExtension(fname, ".wav") == false) {
+        samples.resize(bytes.size()/2);
+        for (size_t i = 0; i < samples.size(); ++i) {
+            samples[i] = ((int16_t) u16(2*i))/32768.0f;
+        }
+        return true;
+    }
+
+    if (bytes.size() < 12 || memcmp(bytes.data(), "RIFF", 4) != 0 || memcmp(bytes.data() + 8, "WAVE", 4) != 0) {
+        printf("'%s' is not a WAV file\n", fname.c_str());
+        return false;
+    }
+
+    int format = -1;
+    int nChannels = 0;
+    int sampleRate = 0;
+    int bitsPerSample = 0;
+
+    size_t p = 12;
+    while (p + 8 <= bytes.size()) {
+        size_t chunkSize = u32(p + 4);
+        size_t chunkStart = p + 8;
+        size_t chunkEnd = std::min(bytes.size(), chunkStart + chunkSize);
+
+        if (memcmp(bytes.data() + p, "fmt ", 4) == 0 && chunkSize >= 16) {
+            format = u16(chunkStart);
+            nChannels = u16(chunkStart + 2);
+            sampleRate = u32(chunkStart + 4);
+            bitsPerSample = u16(chunkStart + 14);
+            if (format == 0xFFFE && chunkSize >= 26) {
+                // WAVE_FORMAT_EXTENSIBLE - the actual format is in the sub-format GUID
+                format = u16(chunkStart + 24);
+            }
+        } else if (memcmp(bytes.data() + p, "data", 4) == 0) {
+            if (nChannels <= 0 || ((format == 1 && bitsPerSample == 16) == false && (format == 3 && bitsPerSample == 32) == false)) {
+                printf("'%s': unsupported WAV format %d (%d bits) - expected 16-bit PCM or 32-bit float\n",
+                       fname.c_str(), format, bitsPerSample);
+                return false;
+            }
+
+            size_t stride = nChannels*bitsPerSample/8;
+            size_t nSamples = (chunkEnd - chunkStart)/stride;
+            samples.resize(nSamples);
+            for (size_t i = 0; i < nSamples; ++i) {
+                size_t q = chunkStart + i*stride;
+                if (format == 1) {
+                    samples[i] = ((int16_t) u16(q))/32768.0f;
+                } else {
+                    uint32_t v = u32(q);
+                    memcpy(&samples[i], &v, sizeof(float));
+                }
+            }
+            break;
+        }
+
+        p = chunkStart + chunkSize + (chunkSize & 1);
+    }
+
+    if (sampleRate <= 0) {
+        printf("'%s': missing fmt or data chunk\n", fname.c_str());
+        return false;
+    }
+
+    if (sampleRate != (int) ::kBaseSampleRate && samples.size() > 1) {
+        printf("Resampling '%s' from %d Hz to %d Hz\n", fname.c_str(), sampleRate, (int) ::kBaseSampleRate);
+        double ratio = sampleRate/::kBaseSampleRate;
+        std::vector<float> resampled((size_t) ((samples.size() - 1)/ratio) + 1);
+        for (size_t i = 0; i < resampled.size(); ++i) {
+            double x = i*ratio;
+            size_t i0 = (size_t) x;
+            size_t i1 = std::min(i0 + 1, samples.size() - 1);
+            float t = x - i0;
+            resampled[i] = (1.0f - t)*samples[i0] + t*samples[i1];
+        }
+        samples.swap(resampled);
+    }
+
+    return true;
+}
+
+// Write mono 16-bit PCM - as a WAV file if the name ends with .wav, raw samples otherwise
+static bool writeAudioFile(const std::string & fname, const std::vector<int16_t> & samples, int sampleRate) {
+    FILE * fout = fopen(fname.c_str(), "wb");
+    if (fout == nullptr) {
+        printf("Failed to open '%s' for writing\n", fname.c_str());
+        return false;
+    }
+
+    if (hasExtension(fname, ".wav")) {
+        uint32_t dataSize = samples.size()*sizeof(int16_t);
+        std::array<uint8_t, 44> header;
+        auto put16 = [&](int p, uint32_t v) { header[p] = v & 0xFF; header[p + 1] = (v >> 8) & 0xFF; };
+        auto put32 = [&](int p, uint32_t v) { put16(p, v & 0xFFFF); put16(p + 2, v >> 16); };
+        memcpy(header.data() + 0, "RIFF", 4);
+        put32(4, 36 + dataSize);
+        memcpy(header.data() + 8, "WAVEfmt ", 8);
+        put32(16, 16);
+        put16(20, 1);
+        put16(22, 1);
+        put32(24, sampleRate);
+        put32(28, sampleRate*sizeof(int16_t));
+        put16(32, sizeof(int16_t));
+        put16(34, 16);
+        memcpy(header.data() + 36, "data", 4);
+        put32(40, dataSize);
+        fwrite(header.data(), 1, header.size(), fout);
+    }
+
+    bool ok = fwrite(samples.data(), sizeof(int16_t), samples.size(), fout) == samples.size();
+    fclose(fout);
+
+    if (ok == false) {
+        printf("Failed to write '%s'\n", fname.c_str());
+    }
+
+    return ok;
+}
+
+static void setTxProtocol(int txProtocol) {
     printf("Selecting Tx protocol %d\n", txProtocol);
+    int modulation = ::Modulation::NibbleFSK;
     switch (txProtocol) {
         case 0:
             {
@@ -1046,12 +608,175 @@ int main(int argc, char** argv) {
                 setParameters(1, 320, 9, 3, 0, 50);
             }
             break;
+        case 4:
+            {
+                printf("Using 'Normal Multi-Tone' Tx Protocol\n");
+                modulation = ::Modulation::CombinatorialFSK;
+                setParameters(1, 40, 9, 6, 0, 50);
+            }
+            break;
+        case 5:
+            {
+                printf("Using 'Fast Multi-Tone' Tx Protocol\n");
+                modulation = ::Modulation::CombinatorialFSK;
+                setParameters(1, 40, 6, 6, 0, 50);
+            }
+            break;
+        case 6:
+            {
+                printf("Using 'Fastest Multi-Tone' Tx Protocol\n");
+                modulation = ::Modulation::CombinatorialFSK;
+                setParameters(1, 40, 3, 6, 0, 50);
+            }
+            break;
+        case 7:
+            {
+                printf("Using 'Normal OFDM' Tx Protocol\n");
+                modulation = ::Modulation::DifferentialOFDM;
+                setParameters(1, 40, 9, 3, 0, 50);
+            }
+            break;
+        case 8:
+            {
+                printf("Using 'Fast OFDM' Tx Protocol\n");
+                modulation = ::Modulation::DifferentialOFDM;
+                setParameters(1, 40, 6, 3, 0, 50);
+            }
+            break;
+        case 9:
+            {
+                printf("Using 'Fastest OFDM' Tx Protocol\n");
+                modulation = ::Modulation::DifferentialOFDM;
+                setParameters(1, 40, 3, 3, 0, 50);
+            }
+            break;
         default:
             {
                 printf("Using 'Fast' Tx Protocol\n");
                 setParameters(1, 40, 6, 3, 0, 50);
             }
     };
+    setModulation(modulation);
+}
+
+// Offline encode/decode - runs the encoder and the decoder against audio files instead of the
+// SDL devices, as fast as possible
+static int runOffline(const std::vector<std::string> & args, int txProtocol, int rxMode) {
+    g_encoder = new Encoder(::kBaseSampleRate);
+    g_decoder = new Decoder(::kBaseSampleRate);
+    g_encoder->setLogCallback(logMessage);
+    g_decoder->setLogCallback(logMessage);
+
+    setTxMode(1);
+    setRxMode(rxMode);
+    setTxProtocol(txProtocol);
+
+    int res = 1;
+    if (args[0] == "encode") {
+        std::string text;
+        for (size_t i = 2; i < args.size(); ++i) {
+            if (i > 2) text += " ";
+            text += args[i];
+        }
+
+        std::vector<int16_t> samples;
+        g_encoder->setText(text.data(), text.size());
+        g_encoder->encode(samples);
+
+        if (writeAudioFile(args[1], samples, g_encoder->getSampleRateOut())) {
+            printf("Wrote %d samples to '%s'\n", (int) samples.size(), args[1].c_str());
+            res = 0;
+        }
+    } else {
+        std::vector<float> samples;
+        if (readAudioFile(args[1], samples)) {
+            int nMessages = g_decoder->decode(samples.data(), samples.size());
+
+            // trailing silence, so that a message at the very end of the capture is fully recorded
+            std::vector<float> silence(g_decoder->getSamplesPerFrame(), 0.0f);
+            while (g_decoder->getFramesLeftToRecord() > 0) {
+                nMessages += g_decoder->decode(silence.data(), silence.size());
+            }
+
+            printf("Decoded %d message(s) from '%s'\n", nMessages, args[1].c_str());
+            if (g_printRxStats) {
+                printRxStageStats();
+            }
+            res = nMessages > 0 ? 0 : 1;
+        }
+    }
+
+    delete g_decoder;
+    g_decoder = nullptr;
+    delete g_encoder;
+    g_encoder = nullptr;
+
+    return res;
+}
+#endif
+
+int main(int argc, char** argv) {
+#ifdef __EMSCRIPTEN__
+    printf("Build time: %s\n", BUILD_TIMESTAMP);
+    printf("Press the Init button to start\n");
+
+    g_captureDeviceName = argv[1];
+#else
+    printf("Usage: %s [-cN] [-pN] [-tN] [-rN] [-sN] [-mN]\n", argv[0]);
+    printf("    -cN - select capture device N\n");
+    printf("    -pN - select playback device N\n");
+    printf("    -tN - transmission protocol:\n");
+    printf("          -t0 : Normal\n");
+    printf("          -t1 : Fast (default)\n");
+    printf("          -t2 : Fastest\n");
+    printf("          -t3 : Ultrasonic\n");
+    printf("          -t4 : Normal Multi-Tone - 3 of 16 tones per byte, twice the bytes per symbol\n");
+    printf("          -t5 : Fast Multi-Tone\n");
+    printf("          -t6 : Fastest Multi-Tone\n");
+    printf("          -t7 : Normal OFDM - DQPSK on every tone, 4 times the bytes per symbol\n");
+    printf("          -t8 : Fast OFDM\n");
+    printf("          -t9 : Fastest OFDM\n");
+    printf("    -rN - receiver tone detection:\n");
+    printf("          -r0 : Full spectrum FFT (default)\n");
+    printf("          -r1 : Goertzel tone detector bank\n");
+    printf("          -r2 : Sliding DFT, marker detection every 64 samples\n");
+    printf("    -sN - Tx synthesis:\n");
+    printf("          -s0 : Render the whole message before playing it (default)\n");
+    printf("          -s1 : Stream frames from the audio callback\n");
+    printf("    -mN - print the latencies of the receive stages after each received message (N = 1)\n");
+    printf("\n");
+    printf("Offline mode: %s encode <file> <text> [-tN]\n", argv[0]);
+    printf("              %s decode <file> [-tN] [-rN] [-mN]\n", argv[0]);
+    printf("    Files ending in .wav are WAV, anything else is raw 16-bit mono PCM at 48 kHz\n");
+    printf("\n");
+
+    g_captureDeviceName = nullptr;
+
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i][0] != '-') args.push_back(argv[i]);
+    }
+
+    auto argm = parseCmdArguments(argc, argv);
+    g_captureId = argm["c"].empty() ? 0 : std::stoi(argm["c"]);
+    g_playbackId = argm["p"].empty() ? 0 : std::stoi(argm["p"]);
+    int txProtocol = argm["t"].empty() ? 1 : std::stoi(argm["t"]);
+    int rxMode = argm["r"].empty() ? 0 : std::stoi(argm["r"]);
+    g_txStreaming = argm["s"].empty() ? false : std::stoi(argm["s"]) != 0;
+    g_printRxStats = argm["m"].empty() ? false : std::stoi(argm["m"]) != 0;
+
+    if (args.size() >= 2 && (args[0] == "encode" || args[0] == "decode")) {
+        return runOffline(args, txProtocol, rxMode);
+    }
+#endif
+
+#ifdef __EMSCRIPTEN__
+    emscripten_set_main_loop(update, 60, 1);
+#else
+    init();
+    setTxMode(1);
+    setRxMode(rxMode);
+    setTxProtocol(txProtocol);
     printf("\n");
     std::thread inputThread([]() {
         std::string inputOld = "";
@@ -1071,14 +796,20 @@ int main(int argc, char** argv) {
     });
 
     while (true) {
-        SDL_Delay(1);
+        // sleep until a callback or the input thread has something for us, or a timed state
+        // needs checking - wakeups posted meanwhile are handled by the same update()
+        SDL_SemWaitTimeout(g_wakeup, g_waitTimeout_ms);
+        while (SDL_SemTryWait(g_wakeup) == 0) {}
         update();
     }
 
     inputThread.join();
 #endif
 
-    delete g_data;
+    delete g_decoder;
+    delete g_encoder;
+
+    SDL_DestroySemaphore(g_wakeup);
 
     SDL_PauseAudioDevice(devid_in, 1);
     SDL_CloseAudioDevice(devid_in);
@@ -15,6 +15,14 @@
 #define assert(dummy)
 #endif
 
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
 
 namespace RS {
 
@@ -23,7 +31,7 @@ namespace gf {
 
 /* GF tables pre-calculated for 0x11d primitive polynomial */
 
-const uint8_t exp[512] = {
+constexpr uint8_t exp[512] = {
     0x1, 0x2, 0x4, 0x8, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26, 0x4c,
     0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x3, 0x6, 0xc, 0x18, 0x30, 0x60, 0xc0, 0x9d,
     0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23, 0x46,
@@ -58,7 +66,7 @@ const uint8_t exp[512] = {
     0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x1, 0x2
 };
 
-const uint8_t log[256] = {
+constexpr uint8_t log[256] = {
     0x0, 0x0, 0x1, 0x19, 0x2, 0x32, 0x1a, 0xc6, 0x3, 0xdf, 0x33, 0xee, 0x1b, 0x68, 0xc7, 0x4b, 0x4,
     0x64, 0xe0, 0xe, 0x34, 0x8d, 0xef, 0x81, 0x1c, 0xc1, 0x69, 0xf8, 0xc8, 0x8, 0x4c, 0x71, 0x5,
     0x8a, 0x65, 0x2f, 0xe1, 0x24, 0xf, 0x21, 0x35, 0x93, 0x8e, 0xda, 0xf0, 0x12, 0x82, 0x45, 0x1d,
@@ -104,10 +112,8 @@ inline uint8_t sub(uint8_t x, uint8_t y) {
  * @param x - left operand
  * @param y - rifht operand
  * @return x * y */
-inline uint8_t mul(uint16_t x, uint16_t y){
-    if (x == 0 || y == 0)
-        return 0;
-    return exp[log[x] + log[y]];
+constexpr uint8_t mul(uint16_t x, uint16_t y){
+    return (x == 0 || y == 0) ? 0 : exp[log[x] + log[y]];
 }
 
 /* @brief Division in Galua Fields
@@ -139,6 +145,103 @@ inline uint8_t inverse(uint8_t x){
     return exp[255 - log[x]]; /* == div(1, x); */
 }
 
+/* ######################
+ * # VECTOR OPERATIONS  #
+ * ###################### */
+
+/* Split-nibble multiplication tables: c * x == lo[c][x & 0xf] ^ hi[c][x >> 4],
+ * because multiplication distributes over the xor of the two nibbles. The 16-byte
+ * rows of a constant fit a SIMD register, so a byte shuffle (PSHUFB, TBL, swizzle)
+ * multiplies 16 bytes at once. Built once, on first use. */
+struct MulTables {
+    uint8_t lo[256][16];
+    uint8_t hi[256][16];
+};
+
+inline const MulTables & mul_tables() {
+    struct Builder {
+        MulTables tables;
+        Builder() {
+            for(int c = 0; c < 256; c++){
+                for(int n = 0; n < 16; n++){
+                    tables.lo[c][n] = mul(c, n);
+                    tables.hi[c][n] = mul(c, n << 4);
+                }
+            }
+        }
+    };
+    static const Builder builder;
+    return builder.tables;
+}
+
+/* @brief dst[i] ^= c * src[i] for i < n, or dst[i] = c * src[i] if accumulate is false
+ * @param *dst       - destination bytes
+ * @param *src       - source bytes, either dst itself or not overlapping it
+ * @param c          - constant factor
+ * @param n          - number of bytes
+ * @param accumulate - add to dst instead of overwriting it */
+inline void
+mul_row(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n, bool accumulate) {
+    const uint8_t *lo = mul_tables().lo[c];
+    const uint8_t *hi = mul_tables().hi[c];
+    size_t i = 0;
+
+#if defined(__SSSE3__)
+    const __m128i tlo  = _mm_loadu_si128((const __m128i *) lo);
+    const __m128i thi  = _mm_loadu_si128((const __m128i *) hi);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    for(; i + 16 <= n; i += 16){
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i y = _mm_xor_si128(_mm_shuffle_epi8(tlo, _mm_and_si128(x, mask)),
+                                  _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+        if(accumulate) y = _mm_xor_si128(y, _mm_loadu_si128((const __m128i *)(dst + i)));
+        _mm_storeu_si128((__m128i *)(dst + i), y);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t tlo  = vld1q_u8(lo);
+    const uint8x16_t thi  = vld1q_u8(hi);
+    const uint8x16_t mask = vdupq_n_u8(0x0f);
+    for(; i + 16 <= n; i += 16){
+        uint8x16_t x = vld1q_u8(src + i);
+        uint8x16_t y = veorq_u8(vqtbl1q_u8(tlo, vandq_u8(x, mask)), vqtbl1q_u8(thi, vshrq_n_u8(x, 4)));
+        if(accumulate) y = veorq_u8(y, vld1q_u8(dst + i));
+        vst1q_u8(dst + i, y);
+    }
+#elif defined(__ARM_NEON)
+    const uint8x8x2_t tlo = {{ vld1_u8(lo), vld1_u8(lo + 8) }};
+    const uint8x8x2_t thi = {{ vld1_u8(hi), vld1_u8(hi + 8) }};
+    const uint8x8_t mask  = vdup_n_u8(0x0f);
+    for(; i + 8 <= n; i += 8){
+        uint8x8_t x = vld1_u8(src + i);
+        uint8x8_t y = veor_u8(vtbl2_u8(tlo, vand_u8(x, mask)), vtbl2_u8(thi, vshr_n_u8(x, 4)));
+        if(accumulate) y = veor_u8(y, vld1_u8(dst + i));
+        vst1_u8(dst + i, y);
+    }
+#elif defined(__wasm_simd128__)
+    const v128_t tlo  = wasm_v128_load(lo);
+    const v128_t thi  = wasm_v128_load(hi);
+    const v128_t mask = wasm_i8x16_splat(0x0f);
+    for(; i + 16 <= n; i += 16){
+        v128_t x = wasm_v128_load(src + i);
+        v128_t y = wasm_v128_xor(wasm_i8x16_swizzle(tlo, wasm_v128_and(x, mask)),
+                                 wasm_i8x16_swizzle(thi, wasm_u8x16_shr(x, 4)));
+        if(accumulate) y = wasm_v128_xor(y, wasm_v128_load(dst + i));
+        wasm_v128_store(dst + i, y);
+    }
+#endif
+
+    for(; i < n; i++){
+        uint8_t y = lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+        dst[i] = accumulate ? (dst[i] ^ y) : y;
+    }
+}
+
+/* @brief dst[i] ^= c * src[i] for i < n */
+inline void
+mul_add_row(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+    mul_row(dst, src, c, n, true);
+}
+
 /* ##########################
  * # POLYNOMIALS OPERATIONS #
  * ########################## */
@@ -150,9 +253,7 @@ inline uint8_t inverse(uint8_t x){
 inline void
 poly_scale(const Poly *p, Poly *newp, uint16_t x) {
     newp->length = p->length;
-    for(uint16_t i = 0; i < p->length; i++){
-        newp->at(i) = mul(p->at(i), x);
-    }
+    mul_row(newp->ptr(), p->ptr(), x, p->length, false);
 }
 
 /* @brief Addition of two polynomials
@@ -185,8 +286,8 @@ poly_mul(const Poly *p, const Poly *q, Poly *newp) {
     /* Compute the polynomial multiplication (just like the outer product of two vectors,
      * we multiply each coefficients of p with all coefficients of q) */
     for(uint8_t j = 0; j < q->length; j++){
-        for(uint8_t i = 0; i < p->length; i++){
-            newp->at(i+j) ^= mul(p->at(i), q->at(j)); /* == r[i + j] = gf_add(r[i+j], gf_mul(p[i], q[j])) */
+        if(q->at(j) != 0){
+            mul_add_row(newp->ptr() + j, p->ptr(), q->at(j), p->length); /* == r[i + j] ^= p[i] * q[j] */
         }
     }
 }
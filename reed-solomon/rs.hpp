@@ -19,22 +19,117 @@
 namespace RS {
 
 #define MSG_CNT 3   // message-length polynomials count
-#define POLY_CNT 14 // (ecc_length*2)-length polynomialc count
+#define POLY_CNT 14 // (ecc_length*2 + 1)-length polynomialc count
 
-class ReedSolomon {
-public:
+namespace detail {
+
+/* Compile-time generator polynomial: gen_k = (x + 2^0)(x + 2^1)...(x + 2^(k-1)), highest
+ * power first, built by the same recurrence as ReedSolomon::GeneratorPoly() */
+template<size_t... I> struct index_seq {};
+template<size_t N, size_t... I> struct make_index_seq : make_index_seq<N - 1, N - 1, I...> {};
+template<size_t... I> struct make_index_seq<0, I...> { typedef index_seq<I...> type; };
+
+template<size_t N> struct Coefs {
+    uint8_t c[N];
+};
+
+/* coefficient j of gen_{k+1} = gen_k * (x + 2^k) */
+template<size_t K> constexpr uint8_t next_coef(const Coefs<K + 1> &g, size_t j) {
+    return (j <= K ? g.c[j] : 0) ^ (j >= 1 ? gf::mul(g.c[j - 1], gf::exp[K % 255]) : 0);
+}
+
+template<size_t K, size_t... J> constexpr Coefs<K + 2> next_generator(const Coefs<K + 1> &g, index_seq<J...>) {
+    return Coefs<K + 2>{{ next_coef<K>(g, J)... }};
+}
+
+template<size_t K> struct Generator {
+    static constexpr Coefs<K + 1> value() {
+        return next_generator<K - 1>(Generator<K - 1>::value(), typename make_index_seq<K + 1>::type());
+    }
+};
+
+template<> struct Generator<0> {
+    static constexpr Coefs<1> value() { return Coefs<1>{{ 1 }}; }
+};
+
+/* Lengths and working memory of a codec. With Msg and Ecc given, the lengths are
+ * compile-time constants and the memory is part of the object, so loops over them
+ * have fixed trip counts. Storage<0, 0> takes the lengths at runtime and allocates
+ * its memory once, in the constructor. */
+template<size_t Msg, size_t Ecc>
+struct Storage {
+    static_assert(Msg + Ecc < 256, "the codeword must fit GF(256)");
+
+    static constexpr uint8_t msg_length = Msg;
+    static constexpr uint8_t ecc_length = Ecc;
+    static constexpr Coefs<Ecc + 1> generator = Generator<Ecc>::value();
+
+    Storage(uint8_t, uint8_t) {}
+
+    uint8_t memory_buf[MSG_CNT * (Msg + Ecc) + POLY_CNT * (Ecc * 2 + 1)];
+    uint8_t syndrome_buf[(Msg + Ecc) * Ecc];
+
+    const uint8_t * generator_ptr() const { return generator.c; }
+    bool has_generator() const { return true; }
+    void set_generator(const uint8_t *) {}
+};
+
+template<size_t Msg, size_t Ecc> constexpr uint8_t Storage<Msg, Ecc>::msg_length;
+template<size_t Msg, size_t Ecc> constexpr uint8_t Storage<Msg, Ecc>::ecc_length;
+template<size_t Msg, size_t Ecc> constexpr Coefs<Ecc + 1> Storage<Msg, Ecc>::generator;
+
+template<>
+struct Storage<0, 0> {
     const uint8_t msg_length;
     const uint8_t ecc_length;
 
-    uint8_t * generator_cache = nullptr;
-    bool    generator_cached = false;
+    Storage(uint8_t msg_length_p, uint8_t ecc_length_p) :
+        msg_length(msg_length_p), ecc_length(ecc_length_p),
+        memory_buf(new uint8_t[MSG_CNT * (msg_length + ecc_length) + POLY_CNT * (ecc_length * 2 + 1)]),
+        syndrome_buf(new uint8_t[(msg_length + ecc_length) * ecc_length]),
+        generator_cache(new uint8_t[ecc_length + 1]) {}
+
+    ~Storage() {
+        delete [] memory_buf;
+        delete [] syndrome_buf;
+        delete [] generator_cache;
+    }
+
+    Storage(const Storage &) = delete;
+    Storage & operator=(const Storage &) = delete;
+
+    uint8_t * memory_buf;
+    uint8_t * syndrome_buf;
+
+    uint8_t * generator_cache;
+    bool      generator_cached = false;
+
+    const uint8_t * generator_ptr() const { return generator_cache; }
+    bool has_generator() const { return generator_cached; }
+    void set_generator(const uint8_t *gen) {
+        memcpy(generator_cache, gen, ecc_length + 1);
+        generator_cached = true;
+    }
+};
 
-    ReedSolomon(uint8_t msg_length_p, uint8_t ecc_length_p) :
-        msg_length(msg_length_p), ecc_length(ecc_length_p) {
-        generator_cache = new uint8_t[ecc_length + 1];
+} /* end of detail namespace */
+
+/* Reed-Solomon codec over GF(256). ReedSolomonT<Msg, Ecc> is specialized for one message
+ * and ECC length at compile time; ReedSolomon takes them as constructor arguments. */
+template<size_t Msg, size_t Ecc>
+class ReedSolomonT : private detail::Storage<Msg, Ecc> {
+    typedef detail::Storage<Msg, Ecc> Storage;
+
+public:
+    using Storage::msg_length;
+    using Storage::ecc_length;
+
+    ReedSolomonT(uint8_t msg_length_p = Msg, uint8_t ecc_length_p = Ecc) :
+        Storage(msg_length_p, ecc_length_p) {
+        memory = this->memory_buf;
 
         const uint8_t   enc_len  = msg_length + ecc_length;
-        const uint8_t   poly_len = ecc_length * 2;
+        const uint8_t   poly_len = ecc_length * 2 + 1;
         uint8_t** memptr   = &memory;
         uint16_t  offset   = 0;
 
@@ -60,11 +155,8 @@ public:
         }
     }
 
-    ~ReedSolomon() {
-        delete [] generator_cache;
-        // Dummy destructor, gcc-generated one crashes programm
-        memory = NULL;
-    }
+    ReedSolomonT(const ReedSolomonT &) = delete;
+    ReedSolomonT & operator=(const ReedSolomonT &) = delete;
 
     /* @brief Message block encoding
      * @param *src - input message buffer      (msg_lenth size)
@@ -72,10 +164,6 @@ public:
      void EncodeBlock(const void* src, void* dst) {
         assert(msg_length + ecc_length < 256);
 
-        /* Allocating memory on stack for polynomials storage */
-        uint8_t stack_memory[MSG_CNT * msg_length + POLY_CNT * ecc_length * 2];
-        this->memory = stack_memory;
-
         const uint8_t* src_ptr = (const uint8_t*) src;
         uint8_t* dst_ptr = (uint8_t*) dst;
 
@@ -87,13 +175,12 @@ public:
         msg_in->Reset();
         msg_out->Reset();
 
-        // Using cached generator or generating new one
-        if(generator_cached) {
-            gen->Set(generator_cache, ecc_length + 1);
+        // Using the compile-time or cached generator, or generating a new one
+        if(this->has_generator()) {
+            gen->Set(this->generator_ptr(), ecc_length + 1);
         } else {
             GeneratorPoly();
-            memcpy(generator_cache, gen->ptr(), gen->length);
-            generator_cached = true;
+            this->set_generator(gen->ptr());
         }
 
         // Copying input message to internal polynomial
@@ -106,9 +193,7 @@ public:
         for(uint8_t i = 0; i < msg_length; i++){
             coef = msg_out->at(i);
             if(coef != 0){
-                for(uint32_t j = 1; j < gen->length; j++){
-                    msg_out->at(i+j) ^= gf::mul(gen->at(j), coef);
-                }
+                gf::mul_add_row(msg_out->ptr() + i + 1, gen->ptr() + 1, coef, gen->length - 1);
             }
         }
 
@@ -148,10 +233,6 @@ public:
 
         bool ok;
 
-        /* Allocation memory on stack */
-        uint8_t stack_memory[MSG_CNT * msg_length + POLY_CNT * ecc_length * 2];
-        this->memory = stack_memory;
-
         Poly *msg_in  = &polynoms[ID_MSG_IN];
         Poly *msg_out = &polynoms[ID_MSG_OUT];
         Poly *epos    = &polynoms[ID_ERASURES];
@@ -196,7 +277,8 @@ public:
         if(!has_errors) goto return_corrected_msg;
 
         CalcForneySyndromes(synd, epos, src_len);
-        FindErrorLocator(forney, NULL, epos->length);
+        ok = FindErrorLocator(forney, NULL, epos->length);
+        if(!ok) return 1;
 
         // Reversing syndrome
         // TODO optimize through special Poly flag
@@ -210,7 +292,7 @@ public:
         if(!ok) return 1;
 
         // Error happened while finding errors (so helpfull :D)
-        if(err->length == 0) return 1;
+        if(err->length == 0 && epos->length == 0) return 1;
 
         /* Adding found errors with known */
         for(uint8_t i = 0; i < err->length; i++) {
@@ -218,7 +300,14 @@ public:
         }
 
         // Correcting errors
-        CorrectErrata(synd, epos, msg_in);
+        ok = CorrectErrata(synd, epos, msg_in);
+        if(!ok) return 1;
+
+        // The errata may be beyond what the code can correct - accept only a valid codeword
+        CalcSyndromes(msg_out);
+        for(uint8_t i = 0; i < synd->length; i++) {
+            if(synd->at(i) != 0) return 1;
+        }
 
     return_corrected_msg:
         // Wrighting corrected message to output buffer
@@ -269,8 +358,9 @@ private:
         ID_ERR_EVAL
     };
 
-    // Pointer for polynomials memory on stack
+    // Pointer to the polynomials memory of the storage
     uint8_t* memory;
+    bool syndrome_cached = false;
     Poly polynoms[MSG_CNT + POLY_CNT];
 
     void GeneratorPoly() {
@@ -292,12 +382,37 @@ private:
         }
     }
 
+    /* Syndrome i is msg evaluated at 2^(i-1). Instead of running Horner once per root, the
+     * syndromes are accumulated a message byte at a time: synd += msg[j] * row j of the
+     * cached powers 2^((i-1)*(n-1-j)), which is a single vector kernel call per byte */
     void CalcSyndromes(const Poly *msg) {
         Poly *synd = &polynoms[ID_SYNDROMES];
         synd->length = ecc_length+1;
         synd->at(0) = 0;
-        for(uint8_t i = 1; i < ecc_length+1; i++){
-            synd->at(i) = gf::poly_eval(msg, gf::pow(2, i-1));
+
+        const uint16_t n = msg_length + ecc_length;
+        if(msg->length != n) {
+            for(uint8_t i = 1; i < ecc_length+1; i++){
+                synd->at(i) = gf::poly_eval(msg, gf::pow(2, i-1));
+            }
+            return;
+        }
+
+        uint8_t *syndrome_cache = this->syndrome_buf;
+        if(!syndrome_cached) {
+            for(uint16_t j = 0; j < n; j++){
+                for(uint8_t i = 0; i < ecc_length; i++){
+                    syndrome_cache[j*ecc_length + i] = gf::pow(2, (intmax_t) i*(n - 1 - j));
+                }
+            }
+            syndrome_cached = true;
+        }
+
+        memset(synd->ptr() + 1, 0, ecc_length);
+        for(uint16_t j = 0; j < n; j++){
+            if(msg->at(j) != 0){
+                gf::mul_add_row(synd->ptr() + 1, syndrome_cache + j*ecc_length, msg->at(j), ecc_length);
+            }
         }
     }
 
@@ -339,7 +454,7 @@ private:
         gf::poly_div(mulp, divisor, dst);
     }
 
-    void CorrectErrata(const Poly *synd, const Poly *err_pos, const Poly *msg_in) {
+    bool CorrectErrata(const Poly *synd, const Poly *err_pos, const Poly *msg_in) {
         Poly *c_pos     = &polynoms[ID_COEF_POS];
         Poly *corrected = &polynoms[ID_MSG_OUT];
         c_pos->length = err_pos->length;
@@ -409,6 +524,9 @@ private:
                 err_loc_prime = gf::mul(err_loc_prime, err_loc_prime_temp->at(j));
             }
 
+            /* two errata at the same position */
+            if(err_loc_prime == 0) return false;
+
             y = gf::poly_eval(re_eval, Xi_inv);
             y = gf::mul(gf::pow(X->at(i), 1), y);
 
@@ -416,6 +534,7 @@ private:
         }
 
         gf::poly_add(msg_in, E, corrected);
+        return true;
     }
 
     bool FindErrorLocator(const Poly *synd, Poly *erase_loc = NULL, size_t erase_count = 0) {
@@ -473,8 +592,10 @@ private:
         uint32_t shift = 0;
         while(err_loc->length && err_loc->at(shift) == 0) shift++;
 
-        uint32_t errs = err_loc->length - shift - 1;
-        if(((errs - erase_count) * 2 + erase_count) > ecc_length){
+        /* the locator of the Forney syndromes only covers the errors, which cost twice as
+         * much of the ECC as the erasures */
+        const int errs = err_loc->length - shift - 1;
+        if(errs * 2 + (int) erase_count > ecc_length){
             return false; /* Error count is greater then we can fix! */
         }
 
@@ -526,6 +647,8 @@ private:
     }
 };
 
+typedef ReedSolomonT<0, 0> ReedSolomon;
+
 }
 
 #endif // RS_HPP
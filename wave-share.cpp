@@ -0,0 +1,2915 @@
+/*! \file wave-share.cpp
+ *  \brief Data-over-sound encoder and decoder
+ *  \author Georgi Gerganov
+ */
+
+#include "wave-share.h"
+
+#include "reed-solomon/rs.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <array>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <complex>
+#include <vector>
+#include <atomic>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
+#ifndef __EMSCRIPTEN__
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846f
+#endif
+
+namespace {
+
+constexpr auto kMaxDataBits = 256;
+constexpr auto kMaxSpectrumHistory = 4;
+constexpr auto kMaxRecordedFrames = 64*10;
+constexpr auto kDefaultFixedLength = 82;
+constexpr auto kDefaultFixedECCBytes = 32;
+constexpr auto kMaxAnalysisThreads = 16;
+constexpr auto kMinSamplesPerFrame = 64;
+constexpr auto kStepsPerFrame = 16;
+constexpr auto kCombinatorialGroup = 16;
+constexpr auto kCombinatorialTones = 3;
+constexpr auto kOFDMWindowStart = kStepsPerFrame/4;
+constexpr auto kCaptureRingFrames = 1024;
+constexpr auto kTxQueueSize = 64;
+constexpr auto kTxGapFrames = 2;
+constexpr auto kRxQueueSize = 16;
+constexpr auto kMarkerGatePairs = 2;
+constexpr auto kToneBankSegments = 8;
+constexpr auto kToneBankLanes = 4;
+
+// Radix-2/4 decimation-in-time FFT
+//
+// The plan holds everything that depends only on the transform size: the bit-reversal
+// permutation and the N/2 twiddle factors W_N^k = exp(-2*pi*i*k/N). It is built once per
+// samplesPerFrame and reused for every transform of that size, so the per-call cost is
+// just the butterflies - no allocations and no transcendental functions.
+//
+// A plan for N can also run any smaller power-of-two size N/s by striding through its
+// tables. The real-input transform uses this for its N/2-point complex pass.
+
+struct FFTPlan {
+    void init(int aN) {
+        N = aN;
+        nStages = 0;
+        while ((1 << nStages) < N) ++nStages;
+
+        for (int i = 0; i < N; ++i) {
+            int p = 0;
+            for (int j = 0; j < nStages; ++j) {
+                if (i & (1 << j)) p |= 1 << (nStages - 1 - j);
+            }
+            bitReverse[i] = p;
+        }
+
+        for (int k = 0; k < N/2; ++k) {
+            double phi = -2.0*M_PI*k/N;
+            twiddles[k] = std::complex<float>(std::cos(phi), std::sin(phi));
+        }
+    }
+
+    int N = 0;
+    int nStages = 0;
+
+    std::array<int, kMaxSamplesPerFrame> bitReverse;
+    std::array<std::complex<float>, kMaxSamplesPerFrame/2> twiddles;
+};
+
+inline void transform(const FFTPlan & plan, std::complex<float> * f, int N) {
+    const int stride = plan.N/N;
+
+    int nStages = 0;
+    while ((1 << nStages) < N) ++nStages;
+
+    for (int i = 0; i < N; ++i) {
+        int j = plan.bitReverse[i*stride];
+        if (i < j) std::swap(f[i], f[j]);
+    }
+
+    // with an odd number of stages, do a single radix-2 pass first (all twiddles are 1)
+    int h = 1;
+    if (nStages % 2 == 1) {
+        for (int i = 0; i < N; i += 2) {
+            std::complex<float> t = f[i + 1];
+            f[i + 1] = f[i] - t;
+            f[i] += t;
+        }
+        h = 2;
+    }
+
+    // the remaining stages are merged in pairs into radix-4 butterflies
+    for (; h < N; h *= 4) {
+        const int s1 = stride*N/(2*h);
+        const int s2 = stride*N/(4*h);
+        for (int i = 0; i < N; i += 4*h) {
+            for (int j = 0; j < h; ++j) {
+                const std::complex<float> w1 = plan.twiddles[j*s1];
+                const std::complex<float> w2 = plan.twiddles[j*s2];
+
+                std::complex<float> * a = f + i + j;
+                std::complex<float> * b = a + h;
+                std::complex<float> * c = b + h;
+                std::complex<float> * d = c + h;
+
+                std::complex<float> tb = w1*(*b);
+                std::complex<float> td = w1*(*d);
+                std::complex<float> a1 = *a + tb;
+                std::complex<float> b1 = *a - tb;
+                std::complex<float> c1 = *c + td;
+                std::complex<float> d1 = *c - td;
+
+                std::complex<float> tc = w2*c1;
+                std::complex<float> tw = w2*d1;
+                tw = std::complex<float>(tw.imag(), -tw.real()); // multiply by -i
+
+                *a = a1 + tc;
+                *c = a1 - tc;
+                *b = b1 + tw;
+                *d = b1 - tw;
+            }
+        }
+    }
+}
+
+inline void FFT(const FFTPlan & plan, std::complex<float> * f, float d) {
+    transform(plan, f, plan.N);
+    if (d != 1.0f) {
+        for (int i = 0; i < plan.N; i++) {
+            f[i] *= d; //multiplying by step
+        }
+    }
+}
+
+inline void FFT(const FFTPlan & plan, const float * src, std::complex<float> * dst, float d) {
+    for (int i = 0; i < plan.N; ++i) {
+        dst[i].real(src[i]);
+        dst[i].imag(0);
+    }
+    FFT(plan, dst, d);
+}
+
+// Spectrum of N real samples: dst[k] = X_k for k = 0 .. N/2 (the rest is the mirror image).
+// The even/odd samples are packed into one N/2-point complex transform, and the two spectra
+// are separated afterwards, which halves the work compared to a full N-point complex FFT.
+// dst must hold N/2 + 1 complex values and is also used as the work buffer.
+inline void FFTReal(const FFTPlan & plan, const float * src, std::complex<float> * dst) {
+    const int N = plan.N;
+    const int M = N/2;
+
+    for (int i = 0; i < M; ++i) {
+        dst[i] = std::complex<float>(src[2*i], src[2*i + 1]);
+    }
+
+    transform(plan, dst, M);
+
+    {
+        const std::complex<float> z0 = dst[0];
+        dst[0] = z0.real() + z0.imag();
+        dst[M] = z0.real() - z0.imag();
+    }
+
+    // X_k = E_k - i*W_N^k*O_k, and the pair (k, M - k) shares E and O up to conjugation
+    for (int k = 1; 2*k <= M; ++k) {
+        const int j = M - k;
+        const std::complex<float> zk = dst[k];
+        const std::complex<float> zj = dst[j];
+        const std::complex<float> ek = 0.5f*(zk + std::conj(zj));
+        const std::complex<float> ok = 0.5f*(zk - std::conj(zj));
+
+        const std::complex<float> tk = plan.twiddles[k]*ok;
+        const std::complex<float> tj = -plan.twiddles[j]*std::conj(ok);
+
+        dst[k] = ek + std::complex<float>(tk.imag(), -tk.real());
+        dst[j] = std::conj(ek) + std::complex<float>(tj.imag(), -tj.real());
+    }
+}
+
+// One-sided power spectrum of N real samples: dst[k] = |X_k|^2 for k = 0 and k = N/2, and
+// |X_k|^2 + |X_{N-k}|^2 = 2|X_k|^2 in between - i.e. the mirrored half is already folded in.
+// work must hold N/2 + 1 complex values. Returns the total spectrum power.
+inline double FFTPowerSpectrum(const FFTPlan & plan, const float * src, float * dst, std::complex<float> * work) {
+    const int M = plan.N/2;
+
+    FFTReal(plan, src, work);
+
+    double fsum = 0.0;
+    for (int k = 0; k <= M; ++k) {
+        float p = std::norm(work[k]);
+        dst[k] = (k == 0 || k == M) ? p : 2.0f*p;
+        fsum += dst[k];
+    }
+
+    return fsum;
+}
+
+// Goertzel detector bank
+//
+// Evaluates the power of a fixed set of DFT bins directly from the time samples, at a cost
+// of O(nBins*N). A real FFT of N samples costs about as much as 16 bins, so the bank only pays
+// off for a handful of tones - the ToneBank receiver uses it as a gate on the first marker
+// pairs and falls back to the FFT once they look like a marker.
+// With so few bins the recursion of each bin would serialize on the latency of the previous
+// sample, so the input is split into kToneBankSegments parts that are filtered independently
+// and combined with a phase rotation at the end. The bins are advanced in groups of
+// kToneBankLanes with contiguous state so that the inner loop vectorizes. N must be a multiple
+// of kToneBankSegments.
+// The output matches FFTPowerSpectrum for the evaluated bins, other bins are left untouched.
+
+struct ToneDetectorBank {
+    void init(int aN, const int * aBins, int aNBins) {
+        N = aN;
+        nBins = std::min(aNBins, (int) bins.size());
+        nLanes = kToneBankLanes*((nBins + kToneBankLanes - 1)/kToneBankLanes);
+
+        const int L = N/kToneBankSegments;
+        for (int b = 0; b < nLanes; ++b) {
+            // the padding lanes run with a zero coefficient and are never read
+            bins[b] = (b < nBins) ? aBins[b] : 0;
+            double w = 2.0*M_PI*bins[b]/N;
+            coeffs[b] = (b < nBins) ? 2.0*std::cos(w) : 0.0;
+            sines[b] = std::sin(w);
+            for (int s = 0; s < kToneBankSegments; ++s) {
+                rotations[s*2*kMaxDataBits + b] = std::polar(1.0f, (float) (-w*((s + 1)*L - 1)));
+            }
+        }
+    }
+
+    // returns the total power of the input (Parseval-equivalent to the full spectrum sum)
+    double compute(const float * src, float * dst) {
+        const int L = N/kToneBankSegments;
+        std::fill(s1.begin(), s1.begin() + kToneBankSegments*nLanes, 0.0f);
+        std::fill(s2.begin(), s2.begin() + kToneBankSegments*nLanes, 0.0f);
+
+        std::array<float, kToneBankSegments> energy;
+        energy.fill(0.0f);
+        for (int n = 0; n < N; n += kToneBankSegments) {
+            for (int s = 0; s < kToneBankSegments; ++s) {
+                energy[s] += src[n + s]*src[n + s];
+            }
+        }
+
+        for (int n = 0; n < L; ++n) {
+            for (int s = 0; s < kToneBankSegments; ++s) {
+                const float x = src[s*L + n];
+                float * p1 = s1.data() + s*nLanes;
+                float * p2 = s2.data() + s*nLanes;
+                for (int g = 0; g < nLanes; g += kToneBankLanes) {
+                    for (int l = 0; l < kToneBankLanes; ++l) {
+                        float s0 = x + coeffs[g + l]*p1[g + l] - p2[g + l];
+                        p2[g + l] = p1[g + l];
+                        p1[g + l] = s0;
+                    }
+                }
+            }
+        }
+
+        // s1 - e^{-i*w}*s2 of segment s is e^{i*w*((s + 1)*L - 1)}*sum_j x[s*L + j]*e^{-i*w*(s*L + j)}
+        for (int b = 0; b < nBins; ++b) {
+            const float c = 0.5f*coeffs[b];
+            std::complex<float> X = 0.0f;
+            for (int s = 0; s < kToneBankSegments; ++s) {
+                const int j = s*nLanes + b;
+                X += rotations[s*2*kMaxDataBits + b]*std::complex<float>(s1[j] - c*s2[j], sines[b]*s2[j]);
+            }
+            float p = std::norm(X);
+            dst[bins[b]] = (bins[b] == 0 || 2*bins[b] == N) ? p : 2.0f*p;
+        }
+
+        double fsum = 0.0;
+        for (auto e : energy) fsum += e;
+
+        return fsum*N;
+    }
+
+    int N = 0;
+    int nBins = 0;
+    int nLanes = 0;
+
+    std::array<int, 2*kMaxDataBits> bins;
+    std::array<float, 2*kMaxDataBits> coeffs;
+    std::array<float, 2*kMaxDataBits> sines;
+    std::array<std::complex<float>, kToneBankSegments*2*kMaxDataBits> rotations;
+
+    std::array<float, kToneBankSegments*2*kMaxDataBits> s1;
+    std::array<float, kToneBankSegments*2*kMaxDataBits> s2;
+};
+
+// Sliding DFT over a window of nFrames*N samples, advanced in hops
+//
+// Keeps the DFT of a set of bins up to date every `hop` samples. The window is split into
+// hop-sized blocks and the partial DFT of each block is kept in a ring, so a hop costs one
+// new block per bin plus an add/subtract. The running sums are rebuilt from the ring once
+// per revolution, so rounding errors can not accumulate.
+// A block is filtered with a Goertzel recursion that advances all bins at once, one
+// multiply and two adds per sample and bin, and is rotated to its place in the frame at the
+// end. That is cheaper than the recursive sliding DFT, which needs a complex multiply per
+// sample and bin and drifts in single precision. Still, tracking 32 marker bins at every
+// sample costs several times the one FFT per kMaxSpectrumHistory frames of the Spectrum
+// receiver (see the idle bench) - the price of locating the start marker to a hop.
+// For integer bins, the DFT of the nFrames-long window equals the sum of the per-frame DFTs,
+// so compute() gives the same power as the spectrum of the frame-averaged amplitude that
+// the Spectrum and ToneBank receivers use. N must be a power of two.
+
+struct SlidingToneDFT {
+    void init(int aN, int aNFrames, int aHop, const int * aBins, int aNBins) {
+        N = aN;
+        hop = (aHop > 0 && aHop <= N && N % aHop == 0) ? aHop : N/16;
+        nBins = std::min(aNBins, 2*kMaxDataBits);
+        nBlocks = aNFrames*N/hop;
+        norm = 1.0f/aNFrames;
+
+        twiddles.resize(N);
+        for (int n = 0; n < N; ++n) {
+            double phi = -2.0*M_PI*n/N;
+            twiddles[n] = std::complex<float>(std::cos(phi), std::sin(phi));
+        }
+
+        bins.assign(aBins, aBins + nBins);
+        coeffs.resize(nBins);
+        sines.resize(nBins);
+        for (int b = 0; b < nBins; ++b) {
+            double w = 2.0*M_PI*bins[b]/N;
+            coeffs[b] = 2.0*std::cos(w);
+            sines[b] = std::sin(w);
+        }
+
+        blocks.resize(nBlocks*nBins);
+        sums.resize(nBins);
+
+        reset();
+    }
+
+    void reset() {
+        std::fill(blocks.begin(), blocks.end(), 0.0f);
+        std::fill(sums.begin(), sums.end(), 0.0f);
+        blockId = 0;
+        pos = 0;
+    }
+
+    // consume the next `hop` samples
+    void update(const float * x) {
+        std::array<float, 2*kMaxDataBits> s1;
+        std::array<float, 2*kMaxDataBits> s2;
+        std::fill(s1.begin(), s1.begin() + nBins, 0.0f);
+        std::fill(s2.begin(), s2.begin() + nBins, 0.0f);
+
+        for (int j = 0; j < hop; ++j) {
+            const float xj = x[j];
+            for (int b = 0; b < nBins; ++b) {
+                float s0 = xj + coeffs[b]*s1[b] - s2[b];
+                s2[b] = s1[b];
+                s1[b] = s0;
+            }
+        }
+
+        // s1 - e^{-i*w}*s2 is e^{i*w*(hop - 1)}*sum_j x[j]*e^{-i*w*j}
+        std::complex<float> * block = blocks.data() + blockId*nBins;
+        for (int b = 0; b < nBins; ++b) {
+            const std::complex<float> y(s1[b] - 0.5f*coeffs[b]*s2[b], sines[b]*s2[b]);
+            const std::complex<float> acc = twiddles[(bins[b]*(pos + hop - 1)) & (N - 1)]*y;
+            sums[b] += acc - block[b];
+            block[b] = acc;
+        }
+
+        pos = (pos + hop) & (N - 1);
+        if (++blockId == nBlocks) {
+            blockId = 0;
+            std::fill(sums.begin(), sums.end(), 0.0f);
+            for (int i = 0; i < nBlocks; ++i) {
+                for (int b = 0; b < nBins; ++b) {
+                    sums[b] += blocks[i*nBins + b];
+                }
+            }
+        }
+    }
+
+    // one-sided power of the tracked bins, written at their bin index in dst
+    void compute(float * dst) const {
+        for (int b = 0; b < nBins; ++b) {
+            float p = std::norm(sums[b]*norm);
+            dst[bins[b]] = (bins[b] == 0 || 2*bins[b] == N) ? p : 2.0f*p;
+        }
+    }
+
+    int N = 0;
+    int hop = 0;
+    int nBins = 0;
+    int nBlocks = 0;
+    int blockId = 0;
+    int pos = 0;
+    float norm = 1.0f;
+
+    std::vector<int> bins;
+    std::vector<float> coeffs;
+    std::vector<float> sines;
+    std::vector<std::complex<float>> twiddles;
+    std::vector<std::complex<float>> blocks;
+    std::vector<std::complex<float>> sums;
+};
+
+// Spectrogram of the recording on the step grid, restricted to the data tone bins
+//
+// Entry p holds the complex spectrum of the frame-sized window starting at sample p*step.
+// A symbol is the sum of framesPerTx - 1 consecutive windows, and since the DFT is linear
+// its spectrum is the sum of the cached window spectra - neighbouring candidate offsets
+// share all but one window per symbol, so each window is transformed at most once per
+// analysis. Entries are filled on first use; the state flags let analysis threads share
+// the cache without locking - a thread that finds an entry being filled by another one
+// computes its own copy instead of waiting.
+
+struct SpectrogramCache {
+    enum State : uint8_t { Empty = 0, Filling, Ready };
+
+    void init(int aNPositions, int aNBins) {
+        nPositions = aNPositions;
+        nBins = aNBins;
+        if ((int) data.size() < nPositions*nBins) {
+            data.resize(nPositions*nBins);
+        }
+        if ((int) state.size() < nPositions) {
+            state = std::vector<std::atomic<uint8_t>>(nPositions);
+        }
+        for (int p = 0; p < nPositions; ++p) {
+            state[p].store(Empty, std::memory_order_relaxed);
+        }
+    }
+
+    // returns the cached spectrum of position p, or nullptr if the caller has to compute it
+    // into its own buffer. claimed is set if the caller must fill the entry and call ready()
+    std::complex<float> * get(int p, bool & claimed) {
+        claimed = false;
+        uint8_t cur = state[p].load(std::memory_order_acquire);
+        if (cur == Ready) return data.data() + p*nBins;
+
+        uint8_t expected = Empty;
+        if (cur == Empty && state[p].compare_exchange_strong(expected, Filling, std::memory_order_acquire)) {
+            claimed = true;
+            return data.data() + p*nBins;
+        }
+
+        return nullptr;
+    }
+
+    void ready(int p) {
+        state[p].store(Ready, std::memory_order_release);
+    }
+
+    int nPositions = 0;
+    int nBins = 0;
+
+    std::vector<std::complex<float>> data;
+    std::vector<std::atomic<uint8_t>> state;
+};
+
+// Single-producer/single-consumer lock-free ring of captured samples
+//
+// The audio callback appends samples with write() and the decoder reads them in place, a
+// frame at a time. Samples stay in the ring until the decoder releases them, so the frames
+// of the spectrum history and of a recording are used directly from here and are never
+// copied. The producer does not overwrite unreleased samples - what does not fit is
+// rejected and the caller can account for it. The capacity is a whole number of frames,
+// so frames never wrap, and the first frame is mirrored past the end so that any
+// frame-sized window starting inside the ring is contiguous as well. Positions are
+// absolute sample counters.
+struct SampleRing {
+    void init(int aCapacity, int aSamplesPerFrame) {
+        capacity = aCapacity;
+        nMirror = aSamplesPerFrame;
+        data.assign(capacity + nMirror, 0.0f);
+        head.store(0);
+        tail.store(0);
+    }
+
+    // producer
+    int write(const float * src, int n) {
+        long long h = head.load(std::memory_order_relaxed);
+        long long t = tail.load(std::memory_order_acquire);
+        n = std::min<long long>(n, capacity - (h - t));
+
+        int nWritten = 0;
+        while (nWritten < n) {
+            int pos = (h + nWritten)%capacity;
+            int nPart = std::min(n - nWritten, capacity - pos);
+            std::copy(src + nWritten, src + nWritten + nPart, data.begin() + pos);
+            if (pos < nMirror) {
+                int nPartMirror = std::min(nPart, nMirror - pos);
+                std::copy(src + nWritten, src + nWritten + nPartMirror, data.begin() + capacity + pos);
+            }
+            nWritten += nPart;
+        }
+
+        head.store(h + n, std::memory_order_release);
+
+        return n;
+    }
+
+    // consumer
+    long long available() const { return head.load(std::memory_order_acquire); }
+    const float * at(long long pos) const { return data.data() + pos%capacity; }
+    void release(long long pos) { tail.store(pos, std::memory_order_release); }
+
+    int capacity = 0;
+    int nMirror = 0;
+
+    std::vector<float> data;
+    std::atomic<long long> head{0};
+    std::atomic<long long> tail{0};
+};
+
+// Multi-producer/single-consumer lock-free queue of Tx messages
+//
+// A bounded ring of fixed-size slots, after D. Vyukov's bounded MPMC queue with the consumer
+// side reduced to a single reader. Each slot carries a sequence number that tells whether it
+// is free for the producer of a given position or holds the message for the consumer of that
+// position. Producers claim positions with a CAS, so push() may be called from any number of
+// threads and neither side ever blocks or allocates.
+struct TxQueue {
+    struct Slot {
+        std::atomic<long long> seq{0};
+        int length = 0;
+        std::array<char, kMaxLength> text;
+    };
+
+    TxQueue() {
+        for (int i = 0; i < kTxQueueSize; ++i) {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // producers - returns false if the queue is full
+    bool push(const char * text, int length) {
+        long long pos = pushPos.load(std::memory_order_relaxed);
+        Slot * slot = nullptr;
+        while (true) {
+            slot = &slots[pos%kTxQueueSize];
+            long long seq = slot->seq.load(std::memory_order_acquire);
+            if (seq == pos) {
+                if (pushPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (seq < pos) {
+                return false;
+            } else {
+                pos = pushPos.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->length = length;
+        std::copy(text, text + length, slot->text.begin());
+        slot->seq.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    // consumer - returns false if there is no message ready
+    bool pop(int & length, char * text) {
+        Slot & slot = slots[popPos%kTxQueueSize];
+        if (slot.seq.load(std::memory_order_acquire) != popPos + 1) return false;
+
+        length = slot.length;
+        std::copy(slot.text.begin(), slot.text.begin() + length, text);
+        slot.seq.store(popPos + kTxQueueSize, std::memory_order_release);
+        ++popPos;
+
+        return true;
+    }
+
+    bool empty() const {
+        return slots[popPos%kTxQueueSize].seq.load(std::memory_order_acquire) != popPos + 1;
+    }
+
+    std::array<Slot, kTxQueueSize> slots;
+    std::atomic<long long> pushPos{0};
+    long long popPos = 0;
+};
+
+// Decoded messages waiting to be taken by the caller of the Decoder. Filled and drained on
+// the thread that calls process(), so it needs no synchronization. When it is full, the
+// oldest message makes room for the new one
+struct RxQueue {
+    struct Message {
+        int length = 0;
+        std::array<std::uint8_t, kMaxDataSize> data;
+    };
+
+    void push(const std::uint8_t * data, int length) {
+        if (size == kRxQueueSize) {
+            ++first;
+            --size;
+        }
+
+        auto & msg = messages[(first + size)%kRxQueueSize];
+        msg.length = length;
+        std::copy(data, data + kMaxDataSize, msg.data.begin());
+        ++size;
+    }
+
+    // returns the length of the oldest message, or -1 if there is none
+    int pop(std::uint8_t * dst) {
+        if (size == 0) return -1;
+
+        const auto & msg = messages[first%kRxQueueSize];
+        std::copy(msg.data.begin(), msg.data.end(), dst);
+        ++first;
+        --size;
+
+        return msg.length;
+    }
+
+    std::array<Message, kRxQueueSize> messages;
+    int first = 0;
+    int size = 0;
+};
+
+using AmplitudeData   = std::array<float, kMaxSamplesPerFrame>;
+using AmplitudeData16 = std::array<int16_t, kMaxSamplesPerFrame>;
+using SpectrumData    = std::array<float, kMaxSamplesPerFrame>;
+
+// Fused Tx mixer: dst[i] += scalar*envelope(i)*sum_t(tones[t][i])
+// The smoothing envelope only depends on the frame position, so it is computed once per frame
+// instead of once per tone, and all active tones are accumulated in a single vectorized pass.
+inline void mixTonesSmooth(const float * const * tones, int nTones, AmplitudeData & dst, float scalar, int finalId, int cycleMod, int nPerCycle) {
+    if (nTones == 0) return;
+
+    AmplitudeData envelope;
+
+    int nTotal = nPerCycle*finalId;
+    float frac = 0.15f;
+    float ds = frac*nTotal;
+    float ids = 1.0f/ds;
+    int nBegin = frac*nTotal;
+    int nEnd = (1.0f - frac)*nTotal;
+    for (int i = 0; i < finalId; i++) {
+        float k = cycleMod*finalId + i;
+        if (k < nBegin) {
+            envelope[i] = scalar*(k*ids);
+        } else if (k > nEnd) {
+            envelope[i] = scalar*(((float)(nTotal) - k)*ids);
+        } else {
+            envelope[i] = scalar;
+        }
+    }
+
+    int i = 0;
+#if defined(__AVX__)
+    for (; i + 8 <= finalId; i += 8) {
+        __m256 acc = _mm256_loadu_ps(tones[0] + i);
+        for (int t = 1; t < nTones; ++t) acc = _mm256_add_ps(acc, _mm256_loadu_ps(tones[t] + i));
+        __m256 d = _mm256_loadu_ps(dst.data() + i);
+        _mm256_storeu_ps(dst.data() + i, _mm256_add_ps(d, _mm256_mul_ps(_mm256_loadu_ps(envelope.data() + i), acc)));
+    }
+#elif defined(__SSE__)
+    for (; i + 4 <= finalId; i += 4) {
+        __m128 acc = _mm_loadu_ps(tones[0] + i);
+        for (int t = 1; t < nTones; ++t) acc = _mm_add_ps(acc, _mm_loadu_ps(tones[t] + i));
+        __m128 d = _mm_loadu_ps(dst.data() + i);
+        _mm_storeu_ps(dst.data() + i, _mm_add_ps(d, _mm_mul_ps(_mm_loadu_ps(envelope.data() + i), acc)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= finalId; i += 4) {
+        float32x4_t acc = vld1q_f32(tones[0] + i);
+        for (int t = 1; t < nTones; ++t) acc = vaddq_f32(acc, vld1q_f32(tones[t] + i));
+        vst1q_f32(dst.data() + i, vmlaq_f32(vld1q_f32(dst.data() + i), vld1q_f32(envelope.data() + i), acc));
+    }
+#elif defined(__wasm_simd128__)
+    for (; i + 4 <= finalId; i += 4) {
+        v128_t acc = wasm_v128_load(tones[0] + i);
+        for (int t = 1; t < nTones; ++t) acc = wasm_f32x4_add(acc, wasm_v128_load(tones[t] + i));
+        v128_t d = wasm_v128_load(dst.data() + i);
+        wasm_v128_store(dst.data() + i, wasm_f32x4_add(d, wasm_f32x4_mul(wasm_v128_load(envelope.data() + i), acc)));
+    }
+#endif
+    for (; i < finalId; ++i) {
+        float acc = 0.0f;
+        for (int t = 0; t < nTones; ++t) acc += tones[t][i];
+        dst[i] += envelope[i]*acc;
+    }
+}
+
+// Phase-continuous sine tone generator
+//
+// Tone k of the table is sin(omega_k*n + phase_k), where n is the absolute output sample
+// index. fill() anchors the phase at the first requested sample in double precision (one
+// sin/cos per call) and then runs a rotation recurrence, so a frame costs a few multiplies
+// per sample instead of a transcendental call, and consecutive frames join up seamlessly
+// at any output sample rate.
+
+struct ToneGenerator {
+    void init(double sampleRate, int nTones, const double * freqs_hz, const double * phaseOffsets) {
+        for (int k = 0; k < nTones; ++k) {
+            omega[k] = (2.0*M_PI)*freqs_hz[k]/sampleRate;
+            phase[k] = phaseOffsets[k];
+            cosOmega[k] = std::cos(omega[k]);
+            sinOmega[k] = std::sin(omega[k]);
+        }
+    }
+
+    void fill(int k, long long sampleStart, int n, float * dst) const {
+        double phi = std::fmod(omega[k]*sampleStart, 2.0*M_PI) + phase[k];
+        double re = std::cos(phi);
+        double im = std::sin(phi);
+        const double c = cosOmega[k];
+        const double s = sinOmega[k];
+        for (int i = 0; i < n; ++i) {
+            dst[i] = im;
+            double t = re*c - im*s;
+            im = re*s + im*c;
+            re = t;
+        }
+    }
+
+    // Like fill(), but with the phase shifted by phaseShift and the tone scaled by amplitude
+    // and added to dst
+    void add(int k, long long sampleStart, int n, double phaseShift, float amplitude, float * dst) const {
+        double phi = std::fmod(omega[k]*sampleStart, 2.0*M_PI) + phase[k] + phaseShift;
+        double re = amplitude*std::cos(phi);
+        double im = amplitude*std::sin(phi);
+        const double c = cosOmega[k];
+        const double s = sinOmega[k];
+        for (int i = 0; i < n; ++i) {
+            dst[i] += im;
+            double t = re*c - im*s;
+            im = re*s + im*c;
+            re = t;
+        }
+    }
+
+    std::array<double, 2*kMaxDataBits> omega;
+    std::array<double, 2*kMaxDataBits> phase;
+    std::array<double, 2*kMaxDataBits> cosOmega;
+    std::array<double, 2*kMaxDataBits> sinOmega;
+};
+
+template <class T>
+float getTime_ms(const T & tStart, const T & tEnd) {
+    return ((float)(std::chrono::duration_cast<std::chrono::microseconds>(tEnd - tStart).count()))/1000.0;
+}
+
+// The sample rate of an Encoder or a Decoder - the rendered frames must fit the buffers of
+// kMaxSamplesPerFrame samples, so rates above kBaseSampleRate are clamped to it
+int validSampleRate(int sampleRate) {
+    return (sampleRate > 0 && sampleRate < ::kBaseSampleRate) ? sampleRate : (int) ::kBaseSampleRate;
+}
+
+// The frame size of an Encoder or a Decoder - the FFT plan and the sliding DFT need a power of
+// two, so anything else is rounded down to one in [kMinSamplesPerFrame, kMaxSamplesPerFrame]
+int validSamplesPerFrame(int samplesPerFrame) {
+    int n = kMinSamplesPerFrame;
+    while (2*n <= std::min(samplesPerFrame, ::kMaxSamplesPerFrame)) n *= 2;
+    return n;
+}
+
+int getECCBytesForLength(int len) {
+    return std::max(4, 2*(len/5));
+}
+
+// Confidence of a hard decision between the strongest bin and the runner-up - 0 for a tie,
+// 1 if nothing but the chosen bin has any power
+float symbolConfidence(double best, double second) {
+    return best > 0.0 ? 1.0 - second/best : 0.0;
+}
+
+// Codewords of CombinatorialFSK - the kCombinatorialTones tones of each byte value, out of
+// the kCombinatorialGroup tones of its group. Of the C(16, 3) = 560 combinations in
+// lexicographic order every 560/256th one is used, so all tones are sent about equally often
+struct CombinatorialCode {
+    CombinatorialCode() {
+        std::array<std::array<std::uint8_t, kCombinatorialTones>, 560> all;
+        int n = 0;
+        for (int a = 0; a < kCombinatorialGroup; ++a) {
+            for (int b = a + 1; b < kCombinatorialGroup; ++b) {
+                for (int c = b + 1; c < kCombinatorialGroup; ++c) {
+                    all[n++] = {{ (std::uint8_t) a, (std::uint8_t) b, (std::uint8_t) c }};
+                }
+            }
+        }
+        for (int v = 0; v < 256; ++v) {
+            tones[v] = all[(v*n)/256];
+        }
+    }
+
+    std::array<std::array<std::uint8_t, kCombinatorialTones>, 256> tones;
+};
+
+const CombinatorialCode & getCombinatorialCode() {
+    static const CombinatorialCode code;
+    return code;
+}
+
+// Quarter turns of the DQPSK phase for each pair of bits, Gray coded so that the likely
+// error - the neighbouring phase - flips a single bit. The table is its own inverse
+constexpr std::array<std::uint8_t, 4> kGrayQuarterTurns = {{ 0, 1, 3, 2 }};
+
+// The codecs of the two fixed shapes - the FixedLength payload and the VariableLength header
+using FixedLengthRS = RS::ReedSolomonT<kDefaultFixedLength, kDefaultFixedECCBytes>;
+using LengthHeaderRS = RS::ReedSolomonT<1, 2>;
+
+// Runtime RS codecs of the VariableLength payloads, keyed by message and ECC length. A codec
+// is created the first time its shape is needed and then reused, together with its generator
+// polynomial, so that re-encoding or decoding a length seen before does no heap allocation.
+// The ECC length follows from the message length, so one slot per message length is enough
+class RSCodecCache {
+public:
+    RSCodecCache() { codecs.fill(nullptr); }
+    RSCodecCache(const RSCodecCache &) = delete;
+    RSCodecCache & operator=(const RSCodecCache &) = delete;
+
+    ~RSCodecCache() {
+        for (auto codec : codecs) if (codec) delete codec;
+    }
+
+    RS::ReedSolomon & get(int msgLength, int eccLength) {
+        auto & codec = codecs[msgLength];
+        if (codec && codec->ecc_length != eccLength) {
+            delete codec;
+            codec = nullptr;
+        }
+        if (codec == nullptr) {
+            codec = new RS::ReedSolomon(msgLength, eccLength);
+        }
+
+        return *codec;
+    }
+
+private:
+    std::array<RS::ReedSolomon *, kMaxLength + 1> codecs;
+};
+
+using RxClock = std::chrono::high_resolution_clock;
+
+// Adds one call of the given duration to the latency statistics of a receive stage
+void addStageTime(::RxStageStats & stats, double dt_us) {
+    ++stats.count;
+    stats.total_ms += dt_us/1000.0;
+    stats.max_ms = std::max(stats.max_ms, dt_us/1000.0);
+
+    int bin = 0;
+    while (bin < ::kRxStageHistogramBins - 1 && dt_us >= (double) (1ll << bin)) ++bin;
+    ++stats.histogram[bin];
+}
+
+void addStageTime(::RxStageStats & stats, const RxClock::time_point & tStart, const RxClock::time_point & tEnd) {
+    addStageTime(stats, std::chrono::duration_cast<std::chrono::nanoseconds>(tEnd - tStart).count()/1000.0);
+}
+
+void mergeStageStats(::RxStageStats & dst, const ::RxStageStats & src) {
+    dst.count += src.count;
+    dst.total_ms += src.total_ms;
+    dst.max_ms = std::max(dst.max_ms, src.max_ms);
+    for (int i = 0; i < ::kRxStageHistogramBins; ++i) {
+        dst.histogram[i] += src.histogram[i];
+    }
+}
+
+// A recording as seen by the analysis. The receiver hands a copy over when the recording is
+// complete and goes on listening, so it is free to start the next one in the meantime
+struct RecordingInfo {
+    long long start = -1;           // first sample in the capture ring
+    int nFrames = 0;                // recorded frames
+    int duration_frames = 0;        // frames the message can extend over
+    float syncOffset = -1.0f;       // data offset synchronized during the recording, in steps
+    int expectedDataOffset = -1;    // data offset predicted by the sliding marker onset, in samples
+    bool isProbed = false;          // cut to the probed length while the recording goes on
+};
+
+// Scratch buffers and RS codecs for evaluating one candidate offset during analysis.
+// Each analysis thread owns one, so candidates can be decoded concurrently.
+struct AnalysisWorkspace {
+    AnalysisWorkspace() {}
+    AnalysisWorkspace(const AnalysisWorkspace &) = delete;
+    AnalysisWorkspace & operator=(const AnalysisWorkspace &) = delete;
+
+    std::array<std::complex<float>, kMaxSamplesPerFrame> fftOut;
+    std::array<std::complex<float>, 2*kMaxDataBits> windowSpectrum;
+    std::array<std::complex<float>, 2*kMaxDataBits> symbolSpectrum;
+    std::array<std::complex<float>, 2*kMaxDataBits> symbolSpectrum2;
+    SpectrumData spectrum;
+    AmplitudeData windowSamples;
+
+    std::array<std::uint8_t, kMaxDataSize> rxData;
+    std::array<std::uint8_t, kMaxDataSize> encodedData;
+
+    // soft information of the demodulator - the confidence of each byte of encodedData, and
+    // the positions of the least confident ones, to be decoded as erasures
+    std::array<float, kMaxDataSize> byteConfidence;
+    std::array<std::uint8_t, kMaxDataSize> erasures;
+    std::array<std::uint8_t, kMaxDataSize> reencodedData;
+
+    // marker scores of the windows around the candidate offsets, for the synchronization
+    std::array<float, kMaxSamplesPerFrame> markerScores;
+
+    int decodedCandidate = -1;
+    int decodedLength = 0;
+
+    FixedLengthRS rsFixed;
+    LengthHeaderRS rsLength;
+    RSCodecCache rsData;
+
+    // latencies of the stages run by this thread - merged into the decoder after the analysis
+    std::array<::RxStageStats, ::kRxStages> stats;
+
+    // the recording this workspace demodulates, its spectrogram cache and the sliding DFT of
+    // the synchronization - the analysis and the early length probe each have their own
+    const RecordingInfo * recording = nullptr;
+    SpectrogramCache * spectrogram = nullptr;
+    SlidingToneDFT * markerSync = nullptr;
+};
+
+#ifndef __EMSCRIPTEN__
+// Threads for the candidate search, started on first use and kept until destruction, so an
+// analysis does not pay for creating and joining them. run(n, func) calls func(w) for every
+// w in [0, n) - w = 0 on the calling thread, the rest on the pool - and returns when all of
+// them have returned. Only one run() at a time.
+struct WorkerPool {
+    WorkerPool() {}
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool & operator=(const WorkerPool &) = delete;
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            isStopping = true;
+        }
+        cvStart.notify_all();
+        for (auto & t : threads) {
+            t.join();
+        }
+    }
+
+    void run(int nWorkers, const std::function<void(int)> & func) {
+        // new threads wait for the next generation - only run() changes it
+        while ((int) threads.size() < nWorkers - 1) {
+            int w = threads.size() + 1;
+            long long lastGeneration = generation;
+            threads.emplace_back([this, w, lastGeneration]() { loop(w, lastGeneration); });
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &func;
+            nJobWorkers = nWorkers;
+            nPending = nWorkers - 1;
+            ++generation;
+        }
+        cvStart.notify_all();
+
+        func(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cvDone.wait(lock, [this]() { return nPending == 0; });
+        job = nullptr;
+    }
+
+    void loop(int w, long long lastGeneration) {
+        while (true) {
+            const std::function<void(int)> * func = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cvStart.wait(lock, [&]() { return isStopping || generation != lastGeneration; });
+                if (isStopping) return;
+
+                lastGeneration = generation;
+                if (w >= nJobWorkers) continue;
+                func = job;
+            }
+
+            (*func)(w);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--nPending == 0) cvDone.notify_one();
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable cvStart;
+    std::condition_variable cvDone;
+
+    const std::function<void(int)> * job = nullptr;
+    int nJobWorkers = 0;
+    int nPending = 0;
+    long long generation = 0;
+    bool isStopping = false;
+};
+#endif
+}
+
+struct DataRxTx {
+    DataRxTx(int aSampleRateOut, int aSampleRate, int aSamplesPerFrame) {
+        sampleRate = aSampleRate;
+        sampleRateOut = aSampleRateOut;
+        samplesPerFrame = aSamplesPerFrame;
+
+        for (auto & ws : analysisWorkspaces) {
+            ws.recording = &analysisRecording;
+            ws.spectrogram = &spectrogram;
+            ws.markerSync = &markerSync;
+        }
+        probeWorkspace.recording = &probeRecording;
+        probeWorkspace.spectrogram = &probeSpectrogram;
+        probeWorkspace.markerSync = &probeSync;
+
+        init(0, "");
+    }
+
+    ~DataRxTx() {
+        joinAnalysis();
+    }
+
+    DataRxTx(const DataRxTx &) = delete;
+    DataRxTx & operator=(const DataRxTx &) = delete;
+
+    // Hand a progress message to the log callback, if there is one
+    void log(const char * format, ...) const {
+        if (logCallback == nullptr) return;
+
+        std::array<char, 512> buf;
+        va_list args;
+        va_start(args, format);
+        vsnprintf(buf.data(), buf.size(), format, args);
+        va_end(args);
+
+        logCallback(buf.data(), logUserData);
+    }
+
+    void init(int textLength, const char * stext) {
+        if (textLength > ::kMaxLength) {
+            log("Truncating data from %d to 140 bytes", textLength);
+            textLength = ::kMaxLength;
+        }
+
+        const uint8_t * text = reinterpret_cast<const uint8_t *>(stext);
+        frameId = 0;
+        nIterations = 0;
+        hasData = false;
+
+        isamplesPerFrame = 1.0f/samplesPerFrame;
+        sendVolume = ((double)(paramVolume))/100.0f;
+        hzPerFrame = sampleRate/samplesPerFrame;
+        ihzPerFrame = 1.0/hzPerFrame;
+        framesPerTx = paramFramesPerTx;
+
+        nDataBitsPerTx = paramBytesPerTx*8;
+
+        // OFDM sends a DQPSK symbol - 2 bits - on each of the 16*paramBytesPerTx subcarriers of
+        // the band
+        isOFDM = modulation == ::Modulation::DifferentialOFDM && paramFreqDelta == 1;
+        if (isOFDM) {
+            nDataBitsPerTx = 2*16*paramBytesPerTx;
+        }
+        nECCBytesPerTx = (txMode == ::TxMode::FixedLength) ? ::kDefaultFixedECCBytes : getECCBytesForLength(textLength);
+
+        framesToAnalyze = 0;
+        framesLeftToAnalyze = 0;
+        framesToRecord = 0;
+        framesLeftToRecord = 0;
+        nBitsInMarker = 16;
+        nMarkerFrames = 16;
+        nPostMarkerFrames = 0;
+        sendDataLength = (txMode == ::TxMode::FixedLength) ? ::kDefaultFixedLength : textLength + 3;
+
+        d0 = paramFreqDelta/2;
+        freqDelta_hz = hzPerFrame*paramFreqDelta;
+        freqStart_hz = hzPerFrame*paramFreqStart;
+        if (paramFreqDelta == 1) {
+            d0 = 1;
+            freqDelta_hz *= 2;
+        }
+        if (isOFDM) {
+            // the subcarriers must sit on even bins, so that every half frame holds a whole
+            // number of their periods and the first half is a cyclic prefix of the second
+            freqStart_hz = hzPerFrame*(paramFreqStart + paramFreqStart%2);
+        }
+
+        outputBlock.fill(0);
+        encodedData.fill(0);
+        outputFramePos = 0;
+        outputFrameLen = 0;
+
+        for (int k = 0; k < (int) phaseOffsets.size(); ++k) {
+            phaseOffsets[k] = (M_PI*k)/(nDataBitsPerTx);
+        }
+#ifdef __EMSCRIPTEN__
+        std::random_shuffle(phaseOffsets.begin(), phaseOffsets.end());
+#endif
+
+        {
+            // tone 2*k is the "1" tone of bit k, tone 2*k + 1 the "0" tone
+            std::array<double, 2*::kMaxDataBits> toneFreqs_hz;
+            std::array<double, 2*::kMaxDataBits> tonePhases;
+            for (int k = 0; k < (int) dataBits.size(); ++k) {
+                double freq = freqStart_hz + freqDelta_hz*k;
+                dataFreqs_hz[k] = freq;
+
+                toneFreqs_hz[2*k + 0] = freq;
+                toneFreqs_hz[2*k + 1] = freq + hzPerFrame*d0;
+                tonePhases[2*k + 0] = phaseOffsets[k];
+                tonePhases[2*k + 1] = phaseOffsets[k];
+            }
+            toneGenerator.init(sampleRateOut, 2*dataBits.size(), toneFreqs_hz.data(), tonePhases.data());
+
+            for (int k = 0; k < (int) dataBits.size(); ++k) {
+                toneGenerator.fill(2*k + 0, 0, samplesPerFrame, bit1Amplitude[k].data());
+                toneGenerator.fill(2*k + 1, 0, samplesPerFrame, bit0Amplitude[k].data());
+            }
+
+            bit1FrameId.fill(-1);
+            bit0FrameId.fill(-1);
+        }
+
+        {
+            std::array<int, 2*::kMaxDataBits> bins;
+            int nBins = 0;
+
+            for (int i = 0; i < nBitsInMarker; ++i) {
+                int bin = std::round(dataFreqs_hz[i]*ihzPerFrame);
+                bins[nBins++] = bin;
+                bins[nBins++] = bin + d0;
+            }
+            markerBank.init(samplesPerFrame, bins.data(), std::min(nBins, 2*::kMarkerGatePairs));
+            markerSliding.init(samplesPerFrame, ::kMaxSpectrumHistory, paramSlidingHop, bins.data(), nBins);
+            markerSync.init(samplesPerFrame, 1, samplesPerFrame/kStepsPerFrame, bins.data(), nBins);
+            probeSync.init(samplesPerFrame, 1, samplesPerFrame/kStepsPerFrame, bins.data(), nBins);
+
+            nBins = 0;
+            if (isOFDM) {
+                // the subcarriers - every second bin of the frame
+                for (int k = 0; k < nDataBitsPerTx/2; ++k) {
+                    bins[nBins++] = std::round(dataFreqs_hz[k]*ihzPerFrame);
+                }
+            } else if (paramFreqDelta > 1) {
+                for (int i = 0; i < nDataBitsPerTx; ++i) {
+                    int bin = std::round(dataFreqs_hz[i]*ihzPerFrame);
+                    bins[nBins++] = bin;
+                    bins[nBins++] = bin + d0;
+                }
+            } else {
+                int bin = std::round(dataFreqs_hz[0]*ihzPerFrame);
+                int nGroups = (modulation == ::Modulation::CombinatorialFSK) ? paramBytesPerTx : 2*paramBytesPerTx;
+                for (int i = 0; i < nGroups*16; ++i) {
+                    bins[nBins++] = bin + i;
+                }
+            }
+            dataBank.init(samplesPerFrame, bins.data(), nBins);
+        }
+
+        if (textLength > 0) {
+            std::array<char, ::kMaxDataSize> theData;
+            theData.fill(0);
+
+            if (txMode == ::TxMode::FixedLength) {
+                for (int i = 0; i < textLength; ++i) theData[i] = text[i];
+                rsFixed.Encode(theData.data(), encodedData.data());
+            } else {
+                theData[0] = textLength;
+                for (int i = 0; i < textLength; ++i) theData[i + 1] = text[i];
+                rsData.get(textLength, nECCBytesPerTx).Encode(theData.data() + 1, encodedData.data() + 3);
+                rsLength.Encode(theData.data(), encodedData.data());
+            }
+
+            hasData = true;
+        }
+
+        // Rx
+        receivingData = false;
+        analyzingData = false;
+
+        sampleSpectrum.fill(0);
+        historyStart = nextFrame;
+        recordStart = -1;
+        nRecordedFrames = 0;
+
+        nSamplesReceived = 0;
+        markerScoreId = 0;
+        markerScoreHistory.fill(0.0f);
+        expectedDataOffset = -1;
+
+        for (int i = 0; i < samplesPerFrame; ++i) {
+            fftOut[i].real(0.0f);
+            fftOut[i].imag(0.0f);
+        }
+
+        if (fftPlan.N != samplesPerFrame) {
+            fftPlan.init(samplesPerFrame);
+        }
+    }
+
+    // Render the current Tx frame into dst and advance to the next one. Returns the number
+    // of samples written. After the last frame of the message, hasData is cleared.
+    int encodeFrame(int16_t * dst) {
+        int samplesPerFrameOut = (sampleRateOut/sampleRate)*samplesPerFrame;
+
+        int nBytesPerTx = nDataBitsPerTx/8;
+        std::fill(outputBlock.begin(), outputBlock.end(), 0.0f);
+        std::uint16_t nFreq = 0;
+
+        // collect the active tones of this frame and mix them in a single pass
+        std::array<const float *, 2*kMaxDataBits> txTones;
+        int nTones = 0;
+        int cycleMod = 0;
+        int nPerCycle = 1;
+
+        if (frameId < nMarkerFrames) {
+            nFreq = nBitsInMarker;
+            cycleMod = frameId;
+            nPerCycle = nMarkerFrames;
+
+            for (int i = 0; i < nBitsInMarker; ++i) {
+                if (i%2 == 0) {
+                    txTones[nTones++] = txTone(i, true).data();
+                } else {
+                    txTones[nTones++] = txTone(i, false).data();
+                }
+            }
+        } else if (frameId < nMarkerFrames + nPostMarkerFrames) {
+            nFreq = nBitsInMarker;
+            cycleMod = frameId - nMarkerFrames;
+            nPerCycle = nPostMarkerFrames;
+
+            for (int i = 0; i < nBitsInMarker; ++i) {
+                if (i%2 == 0) {
+                    txTones[nTones++] = txTone(i, false).data();
+                } else {
+                    txTones[nTones++] = txTone(i, true).data();
+                }
+            }
+        } else if (frameId <
+                   (nMarkerFrames + nPostMarkerFrames) +
+                   ((sendDataLength + nECCBytesPerTx)/nBytesPerTx + 2)*framesPerTx) {
+            int dataOffset = frameId - nMarkerFrames - nPostMarkerFrames;
+            cycleMod = dataOffset%framesPerTx;
+            nPerCycle = framesPerTx;
+            dataOffset /= framesPerTx;
+            dataOffset *= nBytesPerTx;
+
+            dataBits.fill(0);
+
+            if (isOFDM) {
+                // differential QPSK - the first symbol is the phase reference, after it each symbol
+                // turns every subcarrier by the Gray coded quarter turns of its 2 bits. The
+                // reference phases grow quadratically over the subcarriers, to keep the peaks of
+                // their sum low. The subcarriers have whole periods in every half frame, so all
+                // frames of a symbol are the same and any half frame of it can be demodulated
+                const int nCarriers = nDataBitsPerTx/2;
+                const int symbolId = dataOffset/nBytesPerTx;
+                const float amplitude = sendVolume*0.25f/std::sqrt(0.5f*nCarriers);
+
+                // at the output rate of the receiver a symbol is synthesized once, by a single
+                // transform of its subcarriers, and copied into each of its frames - the
+                // oscillators are only needed to render it at another rate
+                const bool isSynthesized = sampleRateOut == sampleRate;
+                if (isSynthesized && cycleMod == 0) {
+                    std::fill(ofdmSpectrum.begin(), ofdmSpectrum.begin() + samplesPerFrame, 0.0f);
+                }
+
+                for (int k = 0; k < nCarriers; ++k) {
+                    if (symbolId == 0) {
+                        carrierPhase[k] = 0;
+                    } else if (cycleMod == 0) {
+                        int bits = (encodedData[dataOffset - nBytesPerTx + k/4] >> (2*(k%4))) & 3;
+                        carrierPhase[k] = (carrierPhase[k] + ::kGrayQuarterTurns[bits]) & 3;
+                    }
+                    double phi = (M_PI*k*k)/nCarriers + (M_PI*(2*carrierPhase[k] + 1))/4;
+                    if (isSynthesized == false) {
+                        toneGenerator.add(2*k, (long long) frameId*samplesPerFrameOut, samplesPerFrameOut, phi, amplitude, outputBlock.data());
+                    } else if (cycleMod == 0) {
+                        // sin(w*n + theta) is -Im(e^{-i*theta}*e^{-i*w*n}), with the sign of the forward transform
+                        int bin = std::round(dataFreqs_hz[k]*ihzPerFrame);
+                        ofdmSpectrum[bin] = std::polar(amplitude, (float) -(toneGenerator.phase[2*k] + phi));
+                    }
+                }
+
+                if (isSynthesized) {
+                    if (cycleMod == 0) {
+                        ::transform(fftPlan, ofdmSpectrum.data(), samplesPerFrame);
+                        for (int i = 0; i < samplesPerFrame; ++i) {
+                            ofdmSymbol[i] = -ofdmSpectrum[i].imag();
+                        }
+                    }
+                    std::copy(ofdmSymbol.begin(), ofdmSymbol.begin() + samplesPerFrame, outputBlock.begin());
+                }
+
+                // Instead of jumping, the last step of a symbol crossfades into the next one - or
+                // into silence after the last one - and the reference symbol fades in over its
+                // first step. The receiver does not look at the first and the last quarter frame
+                // of a symbol, and an echo of a crossfade at the end of a symbol is over before
+                // the windows of the next one start
+                const int nRamp = samplesPerFrameOut/kStepsPerFrame;
+                if (symbolId == 0 && cycleMod == 0) {
+                    for (int i = 0; i < nRamp; ++i) {
+                        outputBlock[i] *= 0.5f - 0.5f*std::cos(M_PI*(i + 0.5f)/nRamp);
+                    }
+                }
+                if (cycleMod == framesPerTx - 1) {
+                    // the next symbol is periodic, so its oscillators run back into this one
+                    const long long tailStart = (long long) frameId*samplesPerFrameOut + samplesPerFrameOut - nRamp;
+                    const int nSymbols = (sendDataLength + nECCBytesPerTx)/nBytesPerTx + 2;
+                    std::array<float, ::kMaxSamplesPerFrame/kStepsPerFrame> next;
+                    std::fill(next.begin(), next.begin() + nRamp, 0.0f);
+                    for (int k = 0; symbolId + 1 < nSymbols && k < nCarriers; ++k) {
+                        int bits = (encodedData[dataOffset + k/4] >> (2*(k%4))) & 3;
+                        int nextPhase = (carrierPhase[k] + ::kGrayQuarterTurns[bits]) & 3;
+                        double phi = (M_PI*k*k)/nCarriers + (M_PI*(2*nextPhase + 1))/4;
+                        toneGenerator.add(2*k, tailStart, nRamp, phi, amplitude, next.data());
+                    }
+                    for (int i = 0; i < nRamp; ++i) {
+                        float w = 0.5f - 0.5f*std::cos(M_PI*(i + 0.5f)/nRamp);
+                        float & x = outputBlock[samplesPerFrameOut - nRamp + i];
+                        x = (1.0f - w)*x + w*next[i];
+                    }
+                }
+
+                // the rare peaks above full scale turn the whole frame down instead of clipping
+                float peak = 0.0f;
+                for (int i = 0; i < samplesPerFrameOut; ++i) {
+                    peak = std::max(peak, std::fabs(outputBlock[i]));
+                }
+                if (peak > 1.0f) {
+                    for (int i = 0; i < samplesPerFrameOut; ++i) {
+                        outputBlock[i] /= peak;
+                    }
+                }
+                nFreq = 1;
+            } else if (paramFreqDelta > 1) {
+                for (int j = 0; j < nBytesPerTx; ++j) {
+                    for (int i = 0; i < 8; ++i) {
+                        dataBits[j*8 + i] = encodedData[dataOffset + j] & (1 << i);
+                    }
+                }
+
+                for (int k = 0; k < nDataBitsPerTx; ++k) {
+                    ++nFreq;
+                    if (dataBits[k] == false) {
+                        txTones[nTones++] = txTone(k, false).data();
+                        continue;
+                    }
+                    txTones[nTones++] = txTone(k, true).data();
+                }
+            } else {
+                int nGroups = 2*nBytesPerTx;
+                if (modulation == ::Modulation::CombinatorialFSK) {
+                    nGroups = nBytesPerTx;
+                    const auto & code = ::getCombinatorialCode();
+                    for (int j = 0; j < nBytesPerTx; ++j) {
+                        for (auto t : code.tones[encodedData[dataOffset + j]]) {
+                            dataBits[j*::kCombinatorialGroup + t] = 1;
+                        }
+                    }
+                } else {
+                    for (int j = 0; j < nBytesPerTx; ++j) {
+                        {
+                            uint8_t d = encodedData[dataOffset + j] & 15;
+                            dataBits[(2*j + 0)*16 + d] = 1;
+                        }
+                        {
+                            uint8_t d = encodedData[dataOffset + j] & 240;
+                            dataBits[(2*j + 1)*16 + (d >> 4)] = 1;
+                        }
+                    }
+                }
+
+                for (int k = 0; k < nGroups*16; ++k) {
+                    if (dataBits[k] == 0) continue;
+
+                    ++nFreq;
+                    if (k%2) {
+                        txTones[nTones++] = txTone(k/2, false).data();
+                    } else {
+                        txTones[nTones++] = txTone(k/2, true).data();
+                    }
+                }
+            }
+        } else if (txMode == ::TxMode::VariableLength && frameId <
+                   (nMarkerFrames + nPostMarkerFrames) +
+                   ((sendDataLength + nECCBytesPerTx)/nBytesPerTx + 2)*framesPerTx +
+                   (nMarkerFrames)) {
+            nFreq = nBitsInMarker;
+
+            cycleMod = frameId - ((nMarkerFrames + nPostMarkerFrames) + ((sendDataLength + nECCBytesPerTx)/nBytesPerTx + 2)*framesPerTx);
+            nPerCycle = nMarkerFrames;
+            for (int i = 0; i < nBitsInMarker; ++i) {
+                if (i%2 == 0) {
+                    txTones[nTones++] = txTone(i, false).data();
+                } else {
+                    txTones[nTones++] = txTone(i, true).data();
+                }
+            }
+        } else {
+            textToSend = "";
+            hasData = false;
+        }
+
+        ::mixTonesSmooth(txTones.data(), nTones, outputBlock, sendVolume, samplesPerFrameOut, cycleMod, nPerCycle);
+
+        if (nFreq == 0) nFreq = 1;
+        float scale = 1.0f/nFreq;
+        for (int i = 0; i < samplesPerFrameOut; ++i) {
+            outputBlock[i] *= scale;
+        }
+
+        for (int i = 0; i < samplesPerFrameOut; ++i) {
+            dst[i] = std::round(32000.0*outputBlock[i]);
+        }
+        ++frameId;
+
+        return samplesPerFrameOut;
+    }
+
+    // Audio callback side of the streaming Tx: copy the next n samples of the message into
+    // dst, rendering frames as they are needed. Pads with silence once the message is over
+    // and then marks the stream as finished.
+    void streamFrames(int16_t * dst, int n) {
+        if (isStreaming.load(std::memory_order_acquire) == false) {
+            std::fill(dst, dst + n, 0);
+            return;
+        }
+
+        while (n > 0) {
+            if (outputFramePos == outputFrameLen) {
+                outputFrameLen = renderFrame(outputBlock16.data());
+                outputFramePos = 0;
+                if (outputFrameLen == 0) break;
+            }
+
+            int nCopy = std::min(n, outputFrameLen - outputFramePos);
+            std::copy(outputBlock16.begin() + outputFramePos, outputBlock16.begin() + outputFramePos + nCopy, dst);
+            outputFramePos += nCopy;
+            dst += nCopy;
+            n -= nCopy;
+        }
+
+        std::fill(dst, dst + n, 0);
+
+        if (hasData == false && txQueue.empty() && outputFramePos == outputFrameLen) {
+            nGapFramesLeft = 0;
+            isStreaming.store(false, std::memory_order_release);
+        }
+    }
+
+    // Render the next frame of the Tx stream: the current message, then the queued ones with
+    // kTxGapFrames of silence in between, so that the receiver is done with a message before
+    // the start marker of the next one arrives. Returns 0 when there is nothing left to send.
+    int renderFrame(int16_t * dst) {
+        if (hasData == false) {
+            if (txQueue.empty()) return 0;
+
+            if (nGapFramesLeft > 0) {
+                int samplesPerFrameOut = (sampleRateOut/sampleRate)*samplesPerFrame;
+                std::fill(dst, dst + samplesPerFrameOut, 0);
+                --nGapFramesLeft;
+                return samplesPerFrameOut;
+            }
+
+            int textLength = 0;
+            txQueue.pop(textLength, txText.data());
+            init(textLength, txText.data());
+            if (hasData == false) return 0;
+        }
+
+        int n = encodeFrame(dst);
+        if (hasData == false) {
+            nGapFramesLeft = ::kTxGapFrames;
+        }
+
+        return n;
+    }
+
+    bool hasTxPending() const {
+        return hasData || txQueue.empty() == false;
+    }
+
+    // The Tx waveform of tone k for the current frame. The tables built in init() are only
+    // valid for frame 0 when resampling, so in that case the tone is regenerated at the
+    // current output position the first time a frame uses it.
+    const ::AmplitudeData & txTone(int k, bool isOne) {
+        auto & amplitude = isOne ? bit1Amplitude[k] : bit0Amplitude[k];
+        if (sampleRateOut != sampleRate) {
+            auto & lastFrameId = isOne ? bit1FrameId[k] : bit0FrameId[k];
+            if (lastFrameId != frameId) {
+                int samplesPerFrameOut = (sampleRateOut/sampleRate)*samplesPerFrame;
+                toneGenerator.fill(2*k + (isOne ? 0 : 1), (long long) frameId*samplesPerFrameOut, samplesPerFrameOut, amplitude.data());
+                lastFrameId = frameId;
+            }
+        }
+        return amplitude;
+    }
+
+    // Producer side of the capture ring - safe to call from the audio callback. Returns the
+    // number of samples accepted, the rest is counted as dropped.
+    int push(const float * samples, int nSamples) {
+        int nWritten = captureRing.write(samples, nSamples);
+        if (nWritten < nSamples) {
+            nSamplesDropped.fetch_add(nSamples - nWritten, std::memory_order_relaxed);
+        }
+        return nWritten;
+    }
+
+    // Release the ring samples that are no longer needed - everything before the spectrum
+    // history, before the current recording and before the one being analyzed
+    void releaseFrames() {
+        long long keep = nextFrame - (long long) (::kMaxSpectrumHistory - 1)*samplesPerFrame;
+        if (recordStart >= 0) keep = std::min(keep, recordStart);
+        if (analyzingData) keep = std::min(keep, analysisRecording.start);
+        if (keep > captureRing.tail.load(std::memory_order_relaxed)) {
+            captureRing.release(keep);
+        }
+    }
+
+    // Drop the frames captured so far without looking at them, unless a recording is in progress.
+    // A finished analysis is still picked up
+    void skip() {
+        if (receivingData) {
+            receive();
+            return;
+        }
+
+        finishAnalysis(false);
+
+        long long available = captureRing.available();
+        while (nextFrame + samplesPerFrame <= available) {
+            nextFrame += samplesPerFrame;
+        }
+        historyStart = nextFrame;
+        releaseFrames();
+    }
+
+    // Process the complete frames in the capture ring. Returns the number of messages decoded.
+    int receive() {
+        auto tCallStart = std::chrono::high_resolution_clock::now();
+
+        int nMessagesBefore = nMessagesReceived;
+
+        if (needUpdate) {
+            finishAnalysis(true);
+            init(0, "");
+            needUpdate = false;
+        }
+
+        finishAnalysis(false);
+
+        long long available = captureRing.available();
+        while (nextFrame + samplesPerFrame <= available) {
+            // the analysis of a probed length ends the recording as soon as it decodes
+            if (analyzingData && analysisRecording.isProbed) {
+                finishAnalysis(false);
+            }
+
+            auto tFrameStart = ::RxClock::now();
+            const float * frame = captureRing.at(nextFrame);
+            auto tStage = ::RxClock::now();
+            double tDequeue_us = std::chrono::duration_cast<std::chrono::nanoseconds>(tStage - tFrameStart).count()/1000.0;
+
+            {
+                if (++historyId >= ::kMaxSpectrumHistory) {
+                    historyId = 0;
+                }
+
+                if (rxMode == ::RxMode::SlidingDFT) {
+                    if (receivingData == false || (receivingData && txMode == ::TxMode::VariableLength)) {
+                        double fsum = 0.0;
+                        for (int i = 0; i < samplesPerFrame; ++i) {
+                            fsum += frame[i]*frame[i];
+                        }
+
+                        if (fsum < 1e-10) {
+                            hasSignal = false;
+                        } else {
+                            hasSignal = true;
+                        }
+
+                        // marker detection at hop resolution
+                        double tSpectrum_us = 0.0;
+                        double tMarkers_us = 0.0;
+                        for (int h = 0; h < samplesPerFrame; h += markerSliding.hop) {
+                            auto t0 = ::RxClock::now();
+                            markerSliding.update(frame + h);
+                            markerSliding.compute(sampleSpectrum.data());
+                            auto t1 = ::RxClock::now();
+
+                            float score = 0.0f;
+                            for (int i = 0; i < nBitsInMarker; ++i) {
+                                int bin = std::round(dataFreqs_hz[i]*ihzPerFrame);
+                                score += (i%2 == 0) ? sampleSpectrum[bin] : sampleSpectrum[bin + d0];
+                            }
+                            markerScoreHistory[markerScoreId] = score;
+                            if (++markerScoreId >= (int) markerScoreHistory.size()) {
+                                markerScoreId = 0;
+                            }
+
+                            bool wasReceiving = receivingData;
+                            detectMarkers();
+
+                            if (wasReceiving == false && receivingData) {
+                                // the recording starts with the current frame
+                                expectedDataOffset = estimateMarkerOnset(nSamplesReceived + h + markerSliding.hop) - nSamplesReceived +
+                                    (nMarkerFrames + nPostMarkerFrames)*samplesPerFrame;
+                            }
+
+                            auto t2 = ::RxClock::now();
+                            tSpectrum_us += std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count()/1000.0;
+                            tMarkers_us += std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count()/1000.0;
+                        }
+
+                        ::addStageTime(rxStats[::RxStage::SpectrumFFT], tSpectrum_us);
+                        ::addStageTime(rxStats[::RxStage::MarkerDetection], tMarkers_us);
+                    }
+                } else if (historyId == 0 && (receivingData == false || (receivingData && txMode == ::TxMode::VariableLength))) {
+                    // the history frames are read in place - frames from before init() count as silence
+                    std::fill(sampleAmplitudeAverage.begin(), sampleAmplitudeAverage.end(), 0.0f);
+                    for (int k = 0; k < ::kMaxSpectrumHistory; ++k) {
+                        long long pos = nextFrame - (long long) k*samplesPerFrame;
+                        if (pos < historyStart) break;
+
+                        const float * s = captureRing.at(pos);
+                        for (int i = 0; i < samplesPerFrame; ++i) {
+                            sampleAmplitudeAverage[i] += s[i];
+                        }
+                    }
+                    float norm = 1.0f/::kMaxSpectrumHistory;
+                    for (int i = 0; i < samplesPerFrame; ++i) {
+                        sampleAmplitudeAverage[i] *= norm;
+                    }
+
+                    auto tAveraged = ::RxClock::now();
+                    ::addStageTime(rxStats[::RxStage::HistoryAverage], tStage, tAveraged);
+
+                    // calculate spectrum
+                    double fsum = 0.0;
+                    if (rxMode == ::RxMode::ToneBank) {
+                        // while idle, the first marker pairs rule out most frames for a fraction
+                        // of the cost of the full spectrum
+                        fsum = markerBank.compute(sampleAmplitudeAverage.data(), sampleSpectrum.data());
+
+                        bool isCandidate = true;
+                        for (int i = 0; i < markerBank.nBins/2; ++i) {
+                            if (isMarkerPair(i, receivingData == false) == false) isCandidate = false;
+                        }
+                        if (isCandidate) {
+                            fsum = FFTPowerSpectrum(fftPlan, sampleAmplitudeAverage.data(), sampleSpectrum.data(), fftOut.data());
+                        }
+                    } else {
+                        fsum = FFTPowerSpectrum(fftPlan, sampleAmplitudeAverage.data(), sampleSpectrum.data(), fftOut.data());
+                    }
+
+                    ::addStageTime(rxStats[::RxStage::SpectrumFFT], tAveraged, ::RxClock::now());
+
+                    if (fsum < 1e-10) {
+                        hasSignal = false;
+                    } else {
+                        hasSignal = true;
+                    }
+                }
+
+                nSamplesReceived += samplesPerFrame;
+
+                if (framesLeftToRecord > 0) {
+                    auto tRecordStart = ::RxClock::now();
+
+                    // the recording stays in the capture ring until it has been analyzed
+                    if (recordStart < 0) {
+                        recordStart = nextFrame;
+                    }
+                    ++nRecordedFrames;
+
+                    if (txMode == ::TxMode::VariableLength && lengthProbed == false) {
+                        probeLength();
+                        collectStageStats(probeWorkspace);
+                    }
+
+                    if (--framesLeftToRecord <= 0) {
+                        startAnalysis();
+                    } else if (nRecordedFrames == probedDuration_frames) {
+                        ::RecordingInfo rec = getRecording();
+                        rec.duration_frames = probedDuration_frames;
+                        rec.isProbed = true;
+                        launchAnalysis(rec);
+                    }
+
+                    ::addStageTime(rxStats[::RxStage::Recording], tRecordStart, ::RxClock::now());
+                }
+            }
+
+            // check if receiving data
+            if (rxMode != ::RxMode::SlidingDFT) {
+                auto tMarkersStart = ::RxClock::now();
+                detectMarkers();
+                ::addStageTime(rxStats[::RxStage::MarkerDetection], tMarkersStart, ::RxClock::now());
+            }
+
+            auto tReleaseStart = ::RxClock::now();
+            nextFrame += samplesPerFrame;
+            releaseFrames();
+            ::addStageTime(rxStats[::RxStage::CaptureDequeue], tDequeue_us +
+                           std::chrono::duration_cast<std::chrono::nanoseconds>(::RxClock::now() - tReleaseStart).count()/1000.0);
+
+            ++nIterations;
+        }
+
+        auto tCallEnd = std::chrono::high_resolution_clock::now();
+        tSum_ms += getTime_ms(tCallStart, tCallEnd);
+        if (++nCalls == 10) {
+            averageRxTime_ms = tSum_ms/nCalls;
+            tSum_ms = 0.0f;
+            nCalls = 0;
+        }
+
+        return nMessagesReceived - nMessagesBefore;
+    }
+
+    // The recording so far, as handed over to the analysis
+    ::RecordingInfo getRecording() const {
+        ::RecordingInfo rec;
+        rec.start = recordStart;
+        rec.nFrames = nRecordedFrames;
+        rec.duration_frames = recvDuration_frames;
+        rec.syncOffset = syncOffset;
+        rec.expectedDataOffset = expectedDataOffset;
+
+        return rec;
+    }
+
+    // Hand a recording over to the analysis, once the previous one is taken over. The recording
+    // stays in the capture ring until the analysis is finished. Without threads the analysis
+    // runs right away
+    void launchAnalysis(const ::RecordingInfo & rec) {
+        finishAnalysis(true);
+
+        analysisRecording = rec;
+
+        framesToAnalyze = nMarkerFrames*kStepsPerFrame;
+        framesLeftToAnalyze = framesToAnalyze;
+        analyzingData = true;
+        analysisDone.store(false, std::memory_order_relaxed);
+
+#ifndef __EMSCRIPTEN__
+        analysisThread = std::thread([this]() {
+            runAnalysis();
+            analysisDone.store(true, std::memory_order_release);
+        });
+#else
+        runAnalysis();
+        analysisDone.store(true, std::memory_order_release);
+#endif
+    }
+
+    // Hand the completed recording over to the analysis and get ready for the next one - unless
+    // the analysis of its probed length has decoded it in the meantime
+    void startAnalysis() {
+        finishAnalysis(true);
+        if (recordStart < 0) return;
+
+        launchAnalysis(getRecording());
+        stopRecording();
+    }
+
+    // Forget the current recording and listen for the next start marker
+    void stopRecording() {
+        receivingData = false;
+        recordStart = -1;
+        nRecordedFrames = 0;
+        framesLeftToRecord = 0;
+
+        std::fill(sampleSpectrum.begin(), sampleSpectrum.end(), 0.0f);
+        markerSliding.reset();
+        markerScoreHistory.fill(0.0f);
+        expectedDataOffset = -1;
+        syncOffset = -1.0f;
+        lengthProbed = false;
+        probedDuration_frames = -1;
+    }
+
+    // Move the latencies collected in a workspace over to the decoder statistics
+    void collectStageStats(::AnalysisWorkspace & ws) {
+        for (int i = 0; i < ::kRxStages; ++i) {
+            ::mergeStageStats(rxStats[i], ws.stats[i]);
+            ws.stats[i] = ::RxStageStats();
+        }
+    }
+
+    // Wait for the analysis thread, without taking over its result
+    void joinAnalysis() {
+#ifndef __EMSCRIPTEN__
+        if (analysisThread.joinable()) {
+            analysisThread.join();
+        }
+#endif
+    }
+
+    // Take over the result of the analysis once it is done - or right away if wait is set.
+    // Returns the number of messages decoded
+    int finishAnalysis(bool wait) {
+        if (analyzingData == false) return 0;
+        if (wait == false && analysisDone.load(std::memory_order_acquire) == false) return 0;
+
+        joinAnalysis();
+
+        for (auto & ws : analysisWorkspaces) {
+            collectStageStats(ws);
+        }
+
+        framesLeftToAnalyze = framesToAnalyze - analysisAttempts;
+
+        const bool isProbed = analysisRecording.isProbed;
+
+        int nDecoded = 0;
+        if (analysisDecoded >= 0) {
+            const auto & ws = analysisWorkspaces[analysisDecoded];
+
+            rxData = ws.rxData;
+            rxDataLength = ws.decodedLength;
+            rxQueue.push(rxData.data(), rxDataLength);
+            int decodedLength = ws.decodedLength;
+            log("Decoded length = %d", decodedLength);
+            if (txMode == ::TxMode::FixedLength && rxData[0] == 'A') {
+                log("[ANSWER] Received sound data successfully!");
+            } else if (txMode == ::TxMode::FixedLength && rxData[0] == 'O') {
+                log("[OFFER]  Received sound data successfully!");
+            } else {
+                std::string s((char *) rxData.data(), decodedLength);
+                log("Received sound data successfully: '%s'", s.c_str());
+            }
+            framesToRecord = 0;
+            ++nMessagesReceived;
+            nDecoded = 1;
+
+            if (isProbed) {
+                stopRecording();
+            }
+        } else if (isProbed) {
+            log("Probed length did not decode, recording the full message");
+        } else {
+            log("Failed to capture sound data. Please try again");
+            framesToRecord = -1;
+        }
+
+        analyzingData = false;
+        analysisRecording = ::RecordingInfo();
+
+        framesToAnalyze = 0;
+        framesLeftToAnalyze = 0;
+
+        releaseFrames();
+
+        return nDecoded;
+    }
+
+    // Offset search over the handed over recording - runs on the analysis thread, so it keeps
+    // its statistics in the workspaces and its result in analysisDecoded and analysisAttempts
+    void runAnalysis() {
+        auto tAnalysisStart = ::RxClock::now();
+
+        const auto & rec = analysisRecording;
+        int stepsPerFrame = kStepsPerFrame;
+        int step = samplesPerFrame/stepsPerFrame;
+
+        // the windows of the last candidate symbol extend framesPerTx frames past the recording
+        spectrogram.init(std::min((rec.duration_frames + framesPerTx)*stepsPerFrame,
+                                  (::kMaxRecordedFrames - 1)*stepsPerFrame + 1), dataBank.nBins);
+
+        // candidate offsets - by default from the latest one back, otherwise starting from
+        // the expected one and moving outwards
+        std::array<int, ::kMaxSamplesPerFrame> candidates;
+        int nCandidates = 0;
+        for (int ii = nMarkerFrames*stepsPerFrame - 1; ii >= nMarkerFrames*stepsPerFrame/2; --ii) {
+            candidates[nCandidates++] = ii;
+        }
+
+        // the offset found by the preamble synchronization - already during the recording
+        // if the length header was probed - or failing that the one predicted by the
+        // marker onset of the sliding receiver
+        float expected = rec.syncOffset;
+        if (expected < 0.0f) {
+            auto tSyncStart = ::RxClock::now();
+            expected = synchronize(candidates[nCandidates - 1], candidates[0], analysisWorkspaces[0]);
+            ::addStageTime(analysisWorkspaces[0].stats[::RxStage::Synchronization], tSyncStart, ::RxClock::now());
+        }
+
+        if (expected < 0.0f && rxMode == ::RxMode::SlidingDFT && rec.expectedDataOffset >= 0) {
+            expected = std::round(((float) rec.expectedDataOffset)/step);
+        }
+        if (expected >= 0.0f) {
+            std::stable_sort(candidates.begin(), candidates.begin() + nCandidates, [expected](int a, int b) {
+                return std::fabs(a - expected) < std::fabs(b - expected);
+            });
+        }
+
+        int nWorkers = 1;
+#ifndef __EMSCRIPTEN__
+        nWorkers = (paramAnalysisThreads > 0) ? paramAnalysisThreads : std::thread::hardware_concurrency();
+        nWorkers = std::max(1, std::min(nWorkers, std::min(nCandidates, ::kMaxAnalysisThreads)));
+#endif
+
+        for (int w = 0; w < nWorkers; ++w) {
+            auto & ws = analysisWorkspaces[w];
+            ws.rxData.fill(0);
+            ws.decodedCandidate = -1;
+        }
+
+        // Candidates are handed out in order. The first (lowest index) candidate that decodes
+        // wins - the workers stop taking candidates after it and abandon the ones after it
+        // that they are demodulating, so the result is the same as trying them one by one.
+        std::atomic<int> nextCandidate(0);
+        std::atomic<int> bestCandidate(nCandidates);
+        std::atomic<int> nAttempts(0);
+
+        auto tryCandidate = [&](int ic, ::AnalysisWorkspace & ws) {
+            ++nAttempts;
+            auto tOffsetStart = ::RxClock::now();
+            bool isDecoded = analyzeOffset(candidates[ic], ic, bestCandidate, ws);
+            ::addStageTime(ws.stats[::RxStage::OffsetSearch], tOffsetStart, ::RxClock::now());
+            if (isDecoded) {
+                ws.decodedCandidate = ic;
+                int best = bestCandidate;
+                while (ic < best && bestCandidate.compare_exchange_weak(best, ic) == false) {}
+            }
+            return isDecoded;
+        };
+
+        auto worker = [&](int w) {
+            auto & ws = analysisWorkspaces[w];
+            while (true) {
+                int ic = nextCandidate++;
+                if (ic >= bestCandidate) break;
+                if (tryCandidate(ic, ws)) break;
+            }
+        };
+
+        // the synchronized offset decodes in the common case - the search only fans out to
+        // the other candidates if it does not
+        if (expected >= 0.0f) {
+            ++nextCandidate;
+            tryCandidate(0, analysisWorkspaces[0]);
+        }
+
+        if (bestCandidate == nCandidates) {
+#ifndef __EMSCRIPTEN__
+            workerPool.run(nWorkers, worker);
+#else
+            worker(0);
+#endif
+        }
+
+        analysisAttempts = nAttempts;
+        analysisDecoded = -1;
+        for (int w = 0; w < nWorkers; ++w) {
+            const auto & ws = analysisWorkspaces[w];
+            if (ws.decodedCandidate >= 0 && ws.decodedCandidate == bestCandidate) {
+                analysisDecoded = w;
+            }
+        }
+
+        ::addStageTime(analysisWorkspaces[0].stats[::RxStage::Analysis], tAnalysisStart, ::RxClock::now());
+    }
+
+    // Spectrum of the data bins for the frame-sized window at the given step position -
+    // from the spectrogram cache, or computed into the workspace if another thread is
+    // filling that entry
+    const std::complex<float> * getWindowSpectrum(int position, ::AnalysisWorkspace & ws) const {
+        auto & spectrogram = *ws.spectrogram;
+        if (position >= spectrogram.nPositions) {
+            std::fill(ws.windowSpectrum.begin(), ws.windowSpectrum.end(), 0.0f);
+            return ws.windowSpectrum.data();
+        }
+
+        bool claimed = false;
+        std::complex<float> * dst = spectrogram.get(position, claimed);
+        if (dst != nullptr && claimed == false) {
+            return dst;
+        }
+        if (dst == nullptr) {
+            dst = ws.windowSpectrum.data();
+        }
+
+        auto tStart = ::RxClock::now();
+
+        // the window is read from the capture ring in place - only a window running past the
+        // end of the recording is copied, to pad it with silence
+        const int offset = position*(samplesPerFrame/kStepsPerFrame);
+        const int nRecorded = ws.recording->nFrames*samplesPerFrame;
+        const float * src = captureRing.at(ws.recording->start + offset);
+        if (offset + samplesPerFrame > nRecorded) {
+            int nValid = std::max(0, nRecorded - offset);
+            std::copy(src, src + nValid, ws.windowSamples.begin());
+            std::fill(ws.windowSamples.begin() + nValid, ws.windowSamples.begin() + samplesPerFrame, 0.0f);
+            src = ws.windowSamples.data();
+        }
+        if (isOFDM) {
+            // the OFDM symbols repeat every half frame, so half a frame is transformed and the
+            // subcarriers are its bins
+            const int M = samplesPerFrame/2;
+            for (int i = 0; i < M; ++i) {
+                ws.fftOut[i] = src[i];
+            }
+            ::transform(fftPlan, ws.fftOut.data(), M);
+            for (int b = 0; b < dataBank.nBins; ++b) {
+                dst[b] = ws.fftOut[dataBank.bins[b]/2];
+            }
+        } else {
+            FFTReal(fftPlan, src, ws.fftOut.data());
+            for (int b = 0; b < dataBank.nBins; ++b) {
+                dst[b] = ws.fftOut[dataBank.bins[b]];
+            }
+        }
+
+        if (claimed) {
+            spectrogram.ready(position);
+        }
+
+        ::addStageTime(ws.stats[::RxStage::CandidateFFT], tStart, ::RxClock::now());
+
+        return dst;
+    }
+
+    // Preamble synchronization. The start marker holds one tone of each pair of marker bins for
+    // nMarkerFrames and the data follows right after it, so the marker score of a window -
+    // the mean over the pairs of (on - off)/(on + off) - stays close to 1 up to one frame
+    // before the data and drops to around 0 from the data on. Matches that edge against the
+    // windows of the recording: for each data offset in [firstOffset, lastOffset] the
+    // contrast is the mean score of the frame of windows ending one frame before it minus
+    // the one of the frame of windows starting at it. Returns the offset of the highest
+    // contrast, refined between the steps with a parabola, or -1 if there is no clear edge.
+    // The windows are tracked step by step with a sliding DFT of the marker bins only
+    float synchronize(int firstOffset, int lastOffset, ::AnalysisWorkspace & ws) const {
+        const int stepsPerFrame = kStepsPerFrame;
+        const int step = samplesPerFrame/stepsPerFrame;
+        const int qStart = std::max(0, firstOffset - 2*stepsPerFrame);
+        const int qEnd = lastOffset + stepsPerFrame;
+        if (qEnd - qStart + 1 > (int) ws.markerScores.size() ||
+            (qEnd + stepsPerFrame)*step > ws.recording->nFrames*samplesPerFrame) {
+            return -1.0f;
+        }
+
+        auto & spectrum = ws.spectrum;
+        auto & markerSync = *ws.markerSync;
+        markerSync.reset();
+        for (int q = qStart - stepsPerFrame + 1; q <= qEnd; ++q) {
+            // the window starting at q ends with the step starting at q + stepsPerFrame - 1
+            markerSync.update(captureRing.at(ws.recording->start + (long long) (q + stepsPerFrame - 1)*step));
+            if (q < qStart) continue;
+
+            markerSync.compute(spectrum.data());
+
+            float score = 0.0f;
+            for (int i = 0; i < nBitsInMarker; ++i) {
+                int bin = std::round(dataFreqs_hz[i]*ihzPerFrame);
+                float p1 = spectrum[bin];
+                float p0 = spectrum[bin + d0];
+                if (p1 + p0 > 0.0f) {
+                    score += ((i%2 == 0) ? p1 - p0 : p0 - p1)/(p1 + p0);
+                }
+            }
+            ws.markerScores[q - qStart] = score/nBitsInMarker;
+        }
+
+        auto contrast = [&](int offset) {
+            float before = 0.0f;
+            float after = 0.0f;
+            for (int k = 0; k <= stepsPerFrame; ++k) {
+                before += ws.markerScores[offset - 2*stepsPerFrame + k - qStart];
+                after += ws.markerScores[offset + k - qStart];
+            }
+            return (before - after)/(stepsPerFrame + 1);
+        };
+
+        int best = -1;
+        float cBest = 0.0f;
+        for (int offset = std::max(firstOffset, qStart + 2*stepsPerFrame); offset <= lastOffset; ++offset) {
+            float c = contrast(offset);
+            if (best < 0 || c > cBest) {
+                best = offset;
+                cBest = c;
+            }
+        }
+
+        // a marker against random data has a contrast of about 1, noise and echoes lower it
+        if (best < 0 || cBest < 0.25f) {
+            return -1.0f;
+        }
+
+        float result = best;
+        if (best > firstOffset && best < lastOffset) {
+            float cm = contrast(best - 1);
+            float cp = contrast(best + 1);
+            float den = cm - 2.0f*cBest + cp;
+            if (den < 0.0f) {
+                result += std::max(-0.5f, std::min(0.5f, 0.5f*(cm - cp)/den));
+            }
+        }
+
+        return result;
+    }
+
+    // Early length header of VariableLength mode, called for each recorded frame until it is
+    // done. Once the recording covers the marker edge, synchronizes, and once it covers the
+    // symbols of the length header, decodes them at the synchronized offset and its
+    // neighbours. If at least two of them agree on the length, the symbols of the actual
+    // message are analyzed right after the last one arrives instead of waiting for the end
+    // marker or the longest possible message. The recording itself goes on until that analysis
+    // decodes, so a wrong length header only costs the time of the full recording. The probe
+    // has buffers of its own, so it does not wait for the analysis of a previous message
+    void probeLength() {
+        const int nBytesPerTx = nDataBitsPerTx/8;
+        const int stepsPerFrame = kStepsPerFrame;
+        const int nRecordedSteps = nRecordedFrames*stepsPerFrame;
+        const int firstOffset = nMarkerFrames*stepsPerFrame/2;
+        const int lastOffset = nMarkerFrames*stepsPerFrame - 1;
+        const int kMaxDeviation = 2;
+
+        auto & ws = probeWorkspace;
+
+        if (syncOffset < 0.0f && nRecordedSteps < lastOffset + 3*stepsPerFrame) return;
+
+        probeRecording.start = recordStart;
+        probeRecording.nFrames = nRecordedFrames;
+        probeRecording.duration_frames = recvDuration_frames;
+
+        if (syncOffset < 0.0f) {
+            auto tSyncStart = ::RxClock::now();
+            probeSpectrogram.init(std::min((recvDuration_frames + framesPerTx)*stepsPerFrame,
+                                           (::kMaxRecordedFrames - 1)*stepsPerFrame + 1), dataBank.nBins);
+            syncOffset = synchronize(firstOffset, lastOffset, ws);
+            ::addStageTime(rxStats[::RxStage::Synchronization], tSyncStart, ::RxClock::now());
+
+            if (syncOffset < 0.0f) {
+                lengthProbed = true;
+                return;
+            }
+        }
+
+        // the last window of the header symbols of the latest offset tried must be recorded
+        const int nHeaderSymbols = (3 + nBytesPerTx - 1)/nBytesPerTx;
+        const int offsetSync = std::round(syncOffset);
+        if (nRecordedSteps < offsetSync + kMaxDeviation + (nHeaderSymbols - 1)*framesPerTx*stepsPerFrame + symbolSpan_steps()) {
+            return;
+        }
+        lengthProbed = true;
+
+        int length = -1;
+        int nAgree = 0;
+        for (int d = 0; d <= 2*kMaxDeviation; ++d) {
+            int offset = offsetSync + ((d%2) ? (d + 1)/2 : -d/2);
+            if (offset < 0) continue;
+
+            for (int itx = 0; itx < nHeaderSymbols; ++itx) {
+                demodulateSymbol(offset + itx*framesPerTx*stepsPerFrame, itx, ws);
+            }
+            if (decodeSoft(ws.rsLength, ws.encodedData.data(), ws.byteConfidence.data(), ws, ws.rxData.data()) == false) continue;
+            if (ws.rxData[0] > ::kMaxLength) continue;
+
+            if (length < 0) {
+                length = ws.rxData[0];
+                nAgree = 1;
+            } else if (length == ws.rxData[0]) {
+                ++nAgree;
+            } else {
+                return;
+            }
+        }
+
+        if (nAgree < 2) return;
+
+        // the frames up to the last window of the last symbol of the latest offset tried
+        const int nSymbols = (3 + length + ::getECCBytesForLength(length) + nBytesPerTx - 1)/nBytesPerTx;
+        const int nSteps = offsetSync + kMaxDeviation + (nSymbols - 1)*framesPerTx*stepsPerFrame + symbolSpan_steps();
+        const int nFrames = (nSteps + stepsPerFrame - 1)/stepsPerFrame + 1;
+        if (nFrames < recvDuration_frames) {
+            probedDuration_frames = std::max(nFrames, nRecordedFrames);
+        }
+    }
+
+    // RS decode of one codeword. If the hard decision fails, the least confident half of the
+    // ECC bytes worth of positions are decoded as erasures instead - an erasure takes half the
+    // ECC of an unknown error. The result is only accepted if nothing outside the erasures had
+    // to be corrected, so that the other half of the ECC still checks it
+    template <typename Codec>
+    bool decodeSoft(Codec & rs, const uint8_t * encoded, const float * confidence, ::AnalysisWorkspace & ws, uint8_t * dst) const {
+        const int n = rs.msg_length + rs.ecc_length;
+        const int nErasures = rs.ecc_length/2;
+
+        auto tDecodeStart = ::RxClock::now();
+        bool isDecoded = rs.Decode(encoded, dst) == 0;
+        ::addStageTime(ws.stats[::RxStage::RSDecode], tDecodeStart, ::RxClock::now());
+        if (isDecoded || nErasures == 0) {
+            return isDecoded;
+        }
+
+        auto & erasures = ws.erasures;
+        for (int i = 0; i < n; ++i) erasures[i] = i;
+        std::nth_element(erasures.begin(), erasures.begin() + nErasures, erasures.begin() + n,
+                         [&](uint8_t a, uint8_t b) { return confidence[a] < confidence[b]; });
+
+        tDecodeStart = ::RxClock::now();
+        isDecoded = rs.Decode(encoded, dst, erasures.data(), nErasures) == 0;
+        if (isDecoded) {
+            auto & reencoded = ws.reencodedData;
+            rs.Encode(dst, reencoded.data());
+            for (int i = 0; i < nErasures; ++i) {
+                reencoded[erasures[i]] = encoded[erasures[i]];
+            }
+            isDecoded = std::equal(encoded, encoded + n, reencoded.begin());
+        }
+        ::addStageTime(ws.stats[::RxStage::RSDecode], tDecodeStart, ::RxClock::now());
+
+        return isDecoded;
+    }
+
+    // Demodulate the symbol at the given offset (in steps of samplesPerFrame/kStepsPerFrame)
+    // into the bytes itx*nBytesPerTx... of ws.encodedData, and their confidence into
+    // ws.byteConfidence
+    void demodulateSymbol(int offsetTx, int itx, ::AnalysisWorkspace & ws) const {
+        const int nBytesPerTx = nDataBitsPerTx/8;
+        const int stepsPerFrame = kStepsPerFrame;
+
+        if (isOFDM) {
+            demodulateDQPSK(offsetTx, itx, ws);
+            return;
+        }
+
+        auto & sampleSpectrum = ws.spectrum;
+        auto & encodedData = ws.encodedData;
+
+        const int nBins = dataBank.nBins;
+
+        std::fill(ws.symbolSpectrum.begin(), ws.symbolSpectrum.begin() + nBins, 0.0f);
+        for (int k = 0; k < framesPerTx-1; ++k) {
+            const std::complex<float> * window = getWindowSpectrum(offsetTx + k*stepsPerFrame, ws);
+            for (int b = 0; b < nBins; ++b) {
+                ws.symbolSpectrum[b] += window[b];
+            }
+        }
+
+        for (int b = 0; b < nBins; ++b) {
+            sampleSpectrum[dataBank.bins[b]] = 2.0f*std::norm(ws.symbolSpectrum[b]);
+        }
+
+        // the confidence of a symbol is 1 - (second best)/(best) of its bins, the one of a
+        // byte the lowest of its symbols
+        uint8_t curByte = 0;
+        float curConfidence = 1.0f;
+        if (paramFreqDelta > 1) {
+            for (int i = 0; i < nDataBitsPerTx; ++i) {
+                int k = i%8;
+                int bin = std::round(dataFreqs_hz[i]*ihzPerFrame);
+                if (sampleSpectrum[bin] > 1*sampleSpectrum[bin + d0]) {
+                    curByte += 1 << k;
+                } else if (sampleSpectrum[bin + d0] > 1*sampleSpectrum[bin]) {
+                } else {
+                }
+                curConfidence = std::min(curConfidence, ::symbolConfidence(
+                            std::max(sampleSpectrum[bin], sampleSpectrum[bin + d0]),
+                            std::min(sampleSpectrum[bin], sampleSpectrum[bin + d0])));
+                if (k == 7) {
+                    encodedData[itx*nBytesPerTx + i/8] = curByte;
+                    ws.byteConfidence[itx*nBytesPerTx + i/8] = curConfidence;
+                    curByte = 0;
+                    curConfidence = 1.0f;
+                }
+            }
+        } else if (modulation == ::Modulation::CombinatorialFSK) {
+            // maximum likelihood over the codewords - the one with the most power in its tones
+            const auto & code = ::getCombinatorialCode();
+            for (int j = 0; j < nBytesPerTx; ++j) {
+                const float * p = sampleSpectrum.data() + (int) std::round(dataFreqs_hz[0]*ihzPerFrame) + j*::kCombinatorialGroup;
+
+                int vmax = 0;
+                float smax = -1.0f;
+                float smax2 = 0.0f;
+                for (int v = 0; v < 256; ++v) {
+                    const auto & t = code.tones[v];
+                    float sum = p[t[0]] + p[t[1]] + p[t[2]];
+                    if (sum > smax) {
+                        vmax = v;
+                        smax2 = std::max(smax, 0.0f);
+                        smax = sum;
+                    } else if (sum > smax2) {
+                        smax2 = sum;
+                    }
+                }
+
+                encodedData[itx*nBytesPerTx + j] = vmax;
+                ws.byteConfidence[itx*nBytesPerTx + j] = ::symbolConfidence(smax, smax2);
+            }
+        } else {
+            for (int i = 0; i < 2*nBytesPerTx; ++i) {
+                int bin = std::round(dataFreqs_hz[0]*ihzPerFrame) + i*16;
+
+                int kmax = 0;
+                double amax = 0.0;
+                double amax2 = 0.0;
+                for (int k = 0; k < 16; ++k) {
+                    if (sampleSpectrum[bin + k] > amax) {
+                        kmax = k;
+                        amax2 = amax;
+                        amax = sampleSpectrum[bin + k];
+                    } else if (sampleSpectrum[bin + k] > amax2) {
+                        amax2 = sampleSpectrum[bin + k];
+                    }
+                }
+                curConfidence = std::min(curConfidence, ::symbolConfidence(amax, amax2));
+
+                if (i%2) {
+                    curByte += (kmax << 4);
+                    encodedData[itx*nBytesPerTx + i/2] = curByte;
+                    ws.byteConfidence[itx*nBytesPerTx + i/2] = curConfidence;
+                    curByte = 0;
+                    curConfidence = 1.0f;
+                } else {
+                    curByte = kmax;
+                }
+            }
+        }
+    }
+
+    // OFDM counterpart of demodulateSymbol(). The symbol itx follows the one at offsetTx, which
+    // is its phase reference. The spectra of a symbol are summed over its half-frame windows,
+    // from a quarter of a frame after its start to a quarter of a frame before its end, which
+    // leaves that much slack for the offset either way. The phase turn of a subcarrier is the
+    // nearest quarter turn, and its confidence is how far it is from the next one
+    void demodulateDQPSK(int offsetTx, int itx, ::AnalysisWorkspace & ws) const {
+        const int nBytesPerTx = nDataBitsPerTx/8;
+        const int nCarriers = nDataBitsPerTx/2;
+        const int nWindows = 2*framesPerTx - 1;
+
+        auto & reference = ws.symbolSpectrum;
+        auto & current = ws.symbolSpectrum2;
+        std::fill(reference.begin(), reference.begin() + nCarriers, 0.0f);
+        std::fill(current.begin(), current.begin() + nCarriers, 0.0f);
+        for (int w = 0; w < nWindows; ++w) {
+            const int position = offsetTx + ::kOFDMWindowStart + w*kStepsPerFrame/2;
+            const std::complex<float> * window = getWindowSpectrum(position, ws);
+            for (int k = 0; k < nCarriers; ++k) {
+                reference[k] += window[k];
+            }
+            window = getWindowSpectrum(position + framesPerTx*kStepsPerFrame, ws);
+            for (int k = 0; k < nCarriers; ++k) {
+                current[k] += window[k];
+            }
+        }
+
+        uint8_t curByte = 0;
+        float curConfidence = 1.0f;
+        for (int k = 0; k < nCarriers; ++k) {
+            const std::complex<float> z = current[k]*std::conj(reference[k]);
+            const float re = z.real();
+            const float im = z.imag();
+
+            int quarterTurns = 0;
+            float best = 0.0f;
+            float second = 0.0f;
+            if (std::fabs(re) >= std::fabs(im)) {
+                quarterTurns = re >= 0.0f ? 0 : 2;
+                best = std::fabs(re);
+                second = std::fabs(im);
+            } else {
+                quarterTurns = im >= 0.0f ? 1 : 3;
+                best = std::fabs(im);
+                second = std::fabs(re);
+            }
+
+            curByte |= ::kGrayQuarterTurns[quarterTurns] << (2*(k%4));
+            curConfidence = std::min(curConfidence, ::symbolConfidence(best, second));
+            if (k%4 == 3) {
+                ws.encodedData[itx*nBytesPerTx + k/4] = curByte;
+                ws.byteConfidence[itx*nBytesPerTx + k/4] = curConfidence;
+                curByte = 0;
+                curConfidence = 1.0f;
+            }
+        }
+    }
+
+    // Steps from the start of a symbol to the end of the last window its demodulation reads
+    int symbolSpan_steps() const {
+        if (isOFDM) {
+            return 2*framesPerTx*kStepsPerFrame - ::kOFDMWindowStart;
+        }
+        return (framesPerTx - 1)*kStepsPerFrame;
+    }
+
+    // Demodulate the recording assuming the data starts at the given offset (in steps of
+    // samplesPerFrame/kStepsPerFrame) and try to RS decode it. Only touches the workspace.
+    // Gives up as soon as a candidate before this one has decoded.
+    bool analyzeOffset(int offsetStart, int candidate, const std::atomic<int> & bestCandidate, ::AnalysisWorkspace & ws) const {
+        const int nBytesPerTx = nDataBitsPerTx/8;
+        const int stepsPerFrame = kStepsPerFrame;
+
+        auto & encodedData = ws.encodedData;
+        auto & rxData = ws.rxData;
+
+        bool knownLength = txMode == ::TxMode::FixedLength;
+        int encodedOffset = (txMode == ::TxMode::FixedLength) ? 0 : 3;
+
+        // bytes beyond the end of the recording are never demodulated
+        ws.byteConfidence.fill(0.0f);
+
+        for (int itx = 0; itx < 1024; ++itx) {
+            if (bestCandidate < candidate) {
+                return false;
+            }
+
+            int offsetTx = offsetStart + itx*framesPerTx*stepsPerFrame;
+            if (offsetTx >= ws.recording->duration_frames*stepsPerFrame) {
+                break;
+            }
+
+            demodulateSymbol(offsetTx, itx, ws);
+
+            if (txMode == ::TxMode::VariableLength) {
+                if (itx*nBytesPerTx > 3 && knownLength == false) {
+                    bool isDecoded = decodeSoft(ws.rsLength, encodedData.data(), ws.byteConfidence.data(), ws, rxData.data());
+                    if (isDecoded && (rxData[0] <= 140)) {
+                        knownLength = true;
+                    } else {
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (knownLength && bestCandidate > candidate) {
+            // FixedLength payloads carry no length of their own
+            ws.decodedLength = (txMode == ::TxMode::FixedLength) ? ::kDefaultFixedLength : rxData[0];
+            bool isDecoded = (txMode == ::TxMode::FixedLength) ?
+                decodeSoft(ws.rsFixed, encodedData.data(), ws.byteConfidence.data(), ws, rxData.data()) :
+                decodeSoft(ws.rsData.get(rxData[0], ::getECCBytesForLength(rxData[0])),
+                           encodedData.data() + encodedOffset, ws.byteConfidence.data() + encodedOffset, ws, rxData.data());
+            if (isDecoded) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // whether marker tone pair i of the current spectrum matches the start or the end marker -
+    // the start marker sends the lower tone of the even pairs and the upper tone of the odd ones
+    bool isMarkerPair(int i, bool isStart) const {
+        int bin = std::round(dataFreqs_hz[i]*ihzPerFrame);
+
+        if ((i%2 == 0) == isStart) {
+            return sampleSpectrum[bin] > 3.0f*sampleSpectrum[bin + d0];
+        }
+        return sampleSpectrum[bin] < 3.0f*sampleSpectrum[bin + d0];
+    }
+
+    // check the current spectrum for the start marker, or for the end marker while receiving
+    void detectMarkers() {
+        if (receivingData == false) {
+            bool isReceiving = true;
+
+            for (int i = 0; i < nBitsInMarker; ++i) {
+                if (isMarkerPair(i, true) == false) isReceiving = false;
+            }
+
+            if (isReceiving) {
+                log("Receiving sound data ...");
+                receivingData = true;
+                // OFDM has a reference symbol in front of the data
+                const int nBytesPerTx = nDataBitsPerTx/8;
+                const int nExtraSymbols = isOFDM ? 2 : 1;
+                if (txMode == ::TxMode::FixedLength) {
+                    recvDuration_frames = nMarkerFrames + nPostMarkerFrames + framesPerTx*((::kDefaultFixedLength + ::kDefaultFixedECCBytes)/nBytesPerTx + nExtraSymbols);
+                } else {
+                    recvDuration_frames = nMarkerFrames + nPostMarkerFrames + framesPerTx*((::kMaxLength + ::getECCBytesForLength(::kMaxLength))/nBytesPerTx + nExtraSymbols);
+                }
+                framesToRecord = recvDuration_frames;
+                framesLeftToRecord = recvDuration_frames;
+                syncOffset = -1.0f;
+                lengthProbed = false;
+                probedDuration_frames = -1;
+            }
+        } else if (txMode == ::TxMode::VariableLength) {
+            bool isEnded = true;
+
+            for (int i = 0; i < nBitsInMarker; ++i) {
+                if (isMarkerPair(i, false) == false) isEnded = false;
+            }
+
+            if (isEnded && framesToRecord > 1) {
+                log("Received end marker");
+                recvDuration_frames -= framesLeftToRecord - 1;
+                framesLeftToRecord = 1;
+            }
+        }
+    }
+
+    // Walks back through the per-hop marker scores and returns the sample position at which
+    // the marker tones started to rise above the floor observed before them
+    long long estimateMarkerOnset(long long curSample) const {
+        const int nScores = markerScoreHistory.size();
+        const int hop = markerSliding.hop;
+
+        float floor = markerScoreHistory[0];
+        for (auto s : markerScoreHistory) floor = std::min(floor, s);
+
+        const float cur = markerScoreHistory[(markerScoreId + nScores - 1)%nScores];
+        const float threshold = floor + 0.01f*(cur - floor);
+
+        int nBack = 0;
+        while (nBack < nScores - 1) {
+            int id = (markerScoreId + nScores - 2 - nBack)%nScores;
+            if (markerScoreHistory[id] <= threshold) break;
+            ++nBack;
+        }
+
+        return curSample - (nBack + 1)*hop;
+    }
+
+    int nIterations;
+    bool needUpdate = false;
+
+    int paramFreqDelta = 6;
+    int paramFreqStart = 40;
+    int paramFramesPerTx = 6;
+    int paramBytesPerTx = 2;
+    int paramVolume = 10;
+    int paramSlidingHop = 64;
+    int paramAnalysisThreads = 0;
+
+    // Rx
+    bool receivingData;
+    bool analyzingData;
+
+    ::FFTPlan fftPlan;
+    ::ToneDetectorBank markerBank;
+    ::ToneDetectorBank dataBank;
+    ::SlidingToneDFT markerSliding;
+    ::SlidingToneDFT markerSync;
+    std::array<std::complex<float>, kMaxSamplesPerFrame> fftOut;
+
+    ::SpectrumData sampleSpectrum;
+
+    // the last decoded message, and all of them until they are taken
+    std::array<std::uint8_t, ::kMaxDataSize> rxData{};
+    std::array<std::uint8_t, ::kMaxDataSize> encodedData;
+    int rxDataLength = 0;
+    ::RxQueue rxQueue;
+    int nMessagesReceived = 0;
+    bool hasSignal = false;
+
+    int historyId = 0;
+    ::AmplitudeData sampleAmplitudeAverage;
+
+
+    // capture - frames are processed in place in the ring, starting at sample nextFrame
+    ::SampleRing captureRing;
+    std::atomic<long long> nSamplesDropped{0};
+    long long nextFrame = 0;
+    long long historyStart = 0;
+    long long recordStart = -1;
+    int nRecordedFrames = 0;
+    std::array<::AnalysisWorkspace, ::kMaxAnalysisThreads> analysisWorkspaces;
+    mutable ::SpectrogramCache spectrogram;
+
+    // the analysis of the last recording, on a thread of its own while analyzingData is set -
+    // the receiver picks up its result once analysisDone
+    ::RecordingInfo analysisRecording;
+    std::atomic<bool> analysisDone{false};
+    int analysisDecoded = -1;
+    int analysisAttempts = 0;
+#ifndef __EMSCRIPTEN__
+    std::thread analysisThread;
+    ::WorkerPool workerPool;
+#endif
+
+    long long nSamplesReceived = 0;
+    int markerScoreId = 0;
+    std::array<float, 2*::kMaxSpectrumHistory*::kMaxSamplesPerFrame/16> markerScoreHistory;
+    int expectedDataOffset = -1;
+
+    // early length header of VariableLength mode - the synchronized data offset, in steps,
+    // whether the probing is over for the current recording and the frames the probed length
+    // needs, -1 if it was not found. The probe runs on the receiver thread while a previous
+    // recording may still be analyzed, so it has buffers of its own
+    float syncOffset = -1.0f;
+    bool lengthProbed = false;
+    int probedDuration_frames = -1;
+    ::RecordingInfo probeRecording;
+    ::AnalysisWorkspace probeWorkspace;
+    ::SpectrogramCache probeSpectrogram;
+    ::SlidingToneDFT probeSync;
+
+    // Tx
+    bool hasData;
+    float sampleRate;
+    float sampleRateOut;
+    int samplesPerFrame;
+    float isamplesPerFrame;
+
+    ::AmplitudeData outputBlock;
+    ::AmplitudeData16 outputBlock16;
+
+    // streaming Tx - owned by the audio callback while isStreaming is set
+    std::atomic<bool> isStreaming{false};
+    int outputFramePos = 0;
+    int outputFrameLen = 0;
+
+    // messages waiting to be sent - filled from any thread, drained by renderFrame()
+    ::TxQueue txQueue;
+    std::array<char, ::kMaxLength> txText;
+    int nGapFramesLeft = 0;
+
+    std::array<::AmplitudeData, ::kMaxDataBits> bit1Amplitude;
+    std::array<::AmplitudeData, ::kMaxDataBits> bit0Amplitude;
+
+    ::ToneGenerator toneGenerator;
+    std::array<int, ::kMaxDataBits> bit1FrameId;
+    std::array<int, ::kMaxDataBits> bit0FrameId;
+
+    float sendVolume;
+    float hzPerFrame;
+    float ihzPerFrame;
+
+    int d0 = 1;
+    float freqStart_hz;
+    float freqDelta_hz;
+
+    int frameId;
+    int nRampFrames;
+    int nRampFramesBegin;
+    int nRampFramesEnd;
+    int nRampFramesBlend;
+    int dataId;
+    int framesPerTx;
+    int framesToAnalyze;
+    int framesLeftToAnalyze;
+    int framesToRecord;
+    int framesLeftToRecord;
+    int nBitsInMarker;
+    int nMarkerFrames;
+    int nPostMarkerFrames;
+    int recvDuration_frames;
+
+    ::TxMode txMode = ::TxMode::FixedLength;
+    ::Modulation modulation = ::Modulation::NibbleFSK;
+    bool isOFDM = false;
+    ::RxMode rxMode = ::RxMode::Spectrum;
+
+    std::array<bool, ::kMaxDataBits> dataBits;
+    std::array<std::uint8_t, ::kMaxDataBits> carrierPhase;
+    std::array<std::complex<float>, ::kMaxSamplesPerFrame> ofdmSpectrum;
+    ::AmplitudeData ofdmSymbol;
+    std::array<double, ::kMaxDataBits> phaseOffsets;
+    std::array<double, ::kMaxDataBits> dataFreqs_hz;
+
+    int nDataBitsPerTx;
+    int nECCBytesPerTx;
+    int sendDataLength;
+
+    ::FixedLengthRS rsFixed;
+    ::LengthHeaderRS rsLength;
+    ::RSCodecCache rsData;
+
+    float averageRxTime_ms = 0.0;
+    int nCalls = 0;
+    float tSum_ms = 0.0f;
+    std::array<::RxStageStats, ::kRxStages> rxStats;
+
+    std::string textToSend;
+
+    ::LogCallback logCallback = nullptr;
+    void * logUserData = nullptr;
+};
+
+
+//
+// Encoder
+//
+
+Encoder::Encoder(int sampleRateOut, int samplesPerFrame) {
+    data = new DataRxTx(::validSampleRate(sampleRateOut), ::kBaseSampleRate, ::validSamplesPerFrame(samplesPerFrame));
+}
+
+Encoder::~Encoder() {
+    delete data;
+}
+
+void Encoder::setTxMode(TxMode txMode) {
+    data->txMode = txMode;
+}
+
+void Encoder::setModulation(Modulation modulation) {
+    data->modulation = modulation;
+}
+
+void Encoder::setLogCallback(LogCallback callback, void * userData) {
+    data->logCallback = callback;
+    data->logUserData = userData;
+}
+
+void Encoder::setParameters(int freqDelta, int freqStart, int framesPerTx, int bytesPerTx, int volume) {
+    data->paramFreqDelta = freqDelta;
+    data->paramFreqStart = freqStart;
+    data->paramFramesPerTx = framesPerTx;
+    data->paramBytesPerTx = bytesPerTx;
+    data->paramVolume = volume;
+}
+
+bool Encoder::setText(const char * text, int textLength) {
+    data->init(textLength, text);
+    return data->hasData;
+}
+
+bool Encoder::queueText(const char * text, int textLength) {
+    if (textLength <= 0) return false;
+    if (textLength > ::kMaxLength) {
+        data->log("Truncating data from %d to 140 bytes", textLength);
+        textLength = ::kMaxLength;
+    }
+
+    return data->txQueue.push(text, textLength);
+}
+
+bool Encoder::hasData() const {
+    return data->hasTxPending();
+}
+
+int Encoder::getSampleRateOut() const {
+    return data->sampleRateOut;
+}
+
+int Encoder::getSamplesPerFrameOut() const {
+    return (data->sampleRateOut/data->sampleRate)*data->samplesPerFrame;
+}
+
+int Encoder::encodeFrame(int16_t * dst) {
+    return data->renderFrame(dst);
+}
+
+void Encoder::encode(std::vector<int16_t> & dst) {
+    while (data->hasTxPending()) {
+        int n = data->renderFrame(data->outputBlock16.data());
+        dst.insert(dst.end(), data->outputBlock16.begin(), data->outputBlock16.begin() + n);
+    }
+}
+
+void Encoder::startStreaming() {
+    if (data->hasTxPending()) {
+        data->isStreaming.store(true, std::memory_order_release);
+    }
+}
+
+bool Encoder::isStreaming() const {
+    return data->isStreaming.load(std::memory_order_acquire);
+}
+
+void Encoder::streamFrames(int16_t * dst, int n) {
+    data->streamFrames(dst, n);
+}
+
+//
+// Decoder
+//
+
+Decoder::Decoder(int sampleRate, int samplesPerFrame) {
+    data = new DataRxTx(::validSampleRate(sampleRate), ::validSampleRate(sampleRate), ::validSamplesPerFrame(samplesPerFrame));
+    data->captureRing.init(::kCaptureRingFrames*data->samplesPerFrame, data->samplesPerFrame);
+}
+
+Decoder::~Decoder() {
+    delete data;
+}
+
+void Decoder::setTxMode(TxMode txMode) {
+    data->joinAnalysis();
+    data->txMode = txMode;
+    data->needUpdate = true;
+}
+
+void Decoder::setModulation(Modulation modulation) {
+    data->joinAnalysis();
+    data->modulation = modulation;
+    data->needUpdate = true;
+}
+
+void Decoder::setLogCallback(LogCallback callback, void * userData) {
+    data->joinAnalysis();
+    data->logCallback = callback;
+    data->logUserData = userData;
+}
+
+void Decoder::setRxMode(RxMode rxMode) {
+    data->joinAnalysis();
+    data->rxMode = rxMode;
+    data->needUpdate = true;
+}
+
+void Decoder::setSlidingHop(int hop) {
+    data->joinAnalysis();
+    data->paramSlidingHop = hop;
+    data->needUpdate = true;
+}
+
+void Decoder::setAnalysisThreads(int nThreads) {
+    data->joinAnalysis();
+    data->paramAnalysisThreads = nThreads;
+}
+
+void Decoder::setParameters(int freqDelta, int freqStart, int framesPerTx, int bytesPerTx) {
+    data->joinAnalysis();
+    data->paramFreqDelta = freqDelta;
+    data->paramFreqStart = freqStart;
+    data->paramFramesPerTx = framesPerTx;
+    data->paramBytesPerTx = bytesPerTx;
+    data->needUpdate = true;
+}
+
+int Decoder::push(const float * samples, int nSamples) {
+    return data->push(samples, nSamples);
+}
+
+int Decoder::process() {
+    return data->receive();
+}
+
+void Decoder::skip() {
+    data->skip();
+}
+
+int Decoder::decode(const float * samples, int nSamples) {
+    // the ring always has room for a full recording once the one being analyzed is released,
+    // so every round makes progress
+    int nMessages = 0;
+    while (nSamples > 0) {
+        int nWritten = data->captureRing.write(samples, nSamples);
+        samples += nWritten;
+        nSamples -= nWritten;
+        if (nWritten == 0) {
+            // the ring is held up by the recording being analyzed
+            nMessages += data->finishAnalysis(true);
+        }
+        nMessages += data->receive();
+    }
+
+    // nobody is capturing in the meantime, so the last analysis is waited for
+    nMessages += data->finishAnalysis(true);
+
+    return nMessages;
+}
+
+long long Decoder::getSamplesDropped() const {
+    return data->nSamplesDropped.load(std::memory_order_relaxed);
+}
+
+int Decoder::popRxData(uint8_t * dst) {
+    return data->rxQueue.pop(dst);
+}
+
+int Decoder::getRxDataQueued() const {
+    return data->rxQueue.size;
+}
+
+const uint8_t * Decoder::getRxData() const { return data->rxData.data(); }
+int Decoder::getRxDataLength() const { return data->rxDataLength; }
+bool Decoder::hasSignal() const { return data->hasSignal; }
+int Decoder::getSampleRate() const { return data->sampleRate; }
+int Decoder::getSamplesPerFrame() const { return data->samplesPerFrame; }
+float Decoder::getAverageRxTime_ms() const { return data->averageRxTime_ms; }
+int Decoder::getFramesToRecord() const { return data->framesToRecord; }
+int Decoder::getFramesLeftToRecord() const { return data->framesLeftToRecord; }
+int Decoder::getFramesToAnalyze() const { return data->framesToAnalyze; }
+int Decoder::getFramesLeftToAnalyze() const { return data->framesLeftToAnalyze; }
+
+const RxStageStats & Decoder::getRxStageStats(RxStage stage) const {
+    return data->rxStats[stage];
+}
+
+void Decoder::resetRxStageStats() {
+    data->rxStats.fill(RxStageStats());
+}
+
+const char * Decoder::getRxStageName(RxStage stage) {
+    static const char * kNames[::kRxStages] = {
+        "capture dequeue",
+        "history averaging",
+        "spectrum",
+        "marker detection",
+        "recording",
+        "analysis",
+        "synchronization",
+        "offset search",
+        "candidate FFT",
+        "RS decode",
+    };
+    return kNames[stage];
+}
@@ -0,0 +1,198 @@
+/*! \file wave-share.h
+ *  \brief Data-over-sound encoder and decoder
+ *  \author Georgi Gerganov
+ *
+ *  The modem works on plain sample buffers and keeps all of its state in the Encoder and
+ *  Decoder instances, so any number of them can run side by side in one process. Audio
+ *  devices are left to the frontends (see main.cpp). An instance must not be used from
+ *  more than one thread at a time - the exceptions are Encoder::streamFrames() and
+ *  Decoder::push(), which are meant to be called from the audio callbacks, and
+ *  Encoder::queueText(), which any number of threads may call.
+ */
+
+#ifndef WAVE_SHARE_H
+#define WAVE_SHARE_H
+
+#include <cstdint>
+#include <array>
+#include <vector>
+
+constexpr double kBaseSampleRate = 48000.0;
+constexpr auto kMaxSamplesPerFrame = 1024;
+constexpr auto kMaxDataSize = 256;
+constexpr auto kMaxLength = 140;
+
+enum TxMode {
+    FixedLength = 0,
+    VariableLength,
+};
+
+// How the data bytes are mapped to the tones of the adjacent-bin grid (freqDelta 1) - with a
+// larger freqDelta every bit has a pair of tones of its own
+enum Modulation {
+    NibbleFSK = 0,      // one tone out of 16 for each 4-bit chunk
+    CombinatorialFSK,   // three tones out of 16 for each byte - twice the bytes in the same band
+    DifferentialOFDM,   // DQPSK on all 16*bytesPerTx subcarriers of the band, framesPerTx frames
+                        // per symbol plus a cyclic prefix of half a frame - 4*bytesPerTx bytes each
+};
+
+enum RxMode {
+    Spectrum = 0,
+    ToneBank,
+    SlidingDFT,
+};
+
+// Stages of the receive pipeline, for the latency statistics of the Decoder
+enum RxStage {
+    CaptureDequeue = 0, // taking a frame from the capture ring and releasing the old ones
+    HistoryAverage,     // averaging the frames of the spectrum history
+    SpectrumFFT,        // spectrum of a frame - FFT, tone bank or sliding DFT
+    MarkerDetection,    // looking for the start and end markers in the spectrum
+    Recording,          // adding a frame to the recording
+    Analysis,           // the whole analysis of a recording
+    Synchronization,    // finding the data offset from the start marker
+    OffsetSearch,       // demodulating the recording at one candidate offset
+    CandidateFFT,       // one window spectrum computed for a candidate offset
+    RSDecode,           // one Reed-Solomon decode, of the length or of the data
+};
+
+constexpr auto kRxStages = 10;
+constexpr auto kRxStageHistogramBins = 24;
+
+// Latency of one receive stage. Bin 0 of the histogram counts the calls that took less than
+// 1 us, bin k the ones that took [2^(k-1), 2^k) us - the last bin also counts anything longer
+struct RxStageStats {
+    long long count = 0;
+    double total_ms = 0.0;
+    double max_ms = 0.0;
+    std::array<long long, kRxStageHistogramBins> histogram{};
+};
+
+// Receives the progress messages of an Encoder or a Decoder, one line at a time and without
+// the newline. Nothing is logged unless a callback is set
+typedef void (*LogCallback)(const char * message, void * userData);
+
+struct DataRxTx;
+
+// Renders messages into 16-bit mono PCM at sampleRateOut
+class Encoder {
+public:
+    // Rates above kBaseSampleRate are clamped to it, and samplesPerFrame is rounded down to a
+    // power of two of at most kMaxSamplesPerFrame - see getSampleRateOut()
+    Encoder(int sampleRateOut = kBaseSampleRate, int samplesPerFrame = kMaxSamplesPerFrame);
+    ~Encoder();
+
+    Encoder(const Encoder &) = delete;
+    Encoder & operator=(const Encoder &) = delete;
+
+    void setTxMode(TxMode txMode);
+    void setModulation(Modulation modulation);
+    void setLogCallback(LogCallback callback, void * userData = nullptr);
+    void setParameters(int freqDelta, int freqStart, int framesPerTx, int bytesPerTx, int volume);
+
+    // Start a new message with the current parameters, replacing the one in flight. Returns
+    // false if there is nothing to send
+    bool setText(const char * text, int textLength);
+
+    // Queue a message to be sent after the current one. Safe to call from any thread, also
+    // while streaming - it never blocks. Returns false if the queue is full
+    bool queueText(const char * text, int textLength);
+
+    // True until the last frame of the current message and of all queued ones has been rendered
+    bool hasData() const;
+
+    int getSampleRateOut() const;
+    int getSamplesPerFrameOut() const;
+
+    // Render the next frame of the message into dst, which must hold getSamplesPerFrameOut()
+    // samples. Queued messages follow with a short gap of silence. Returns the number of
+    // samples written
+    int encodeFrame(int16_t * dst);
+
+    // Render the rest of the message and the queued ones, appending the samples to dst
+    void encode(std::vector<int16_t> & dst);
+
+    // Streaming: after startStreaming(), the audio callback pulls the message with streamFrames(),
+    // which renders frames as they are needed and pads with silence after the end of the message
+    void startStreaming();
+    bool isStreaming() const;
+    void streamFrames(int16_t * dst, int n);
+
+private:
+    DataRxTx * data;
+};
+
+// Finds and decodes messages in mono float samples at sampleRate
+class Decoder {
+public:
+    // The arguments are checked like the ones of the Encoder - see getSampleRate() and
+    // getSamplesPerFrame()
+    Decoder(int sampleRate = kBaseSampleRate, int samplesPerFrame = kMaxSamplesPerFrame);
+    ~Decoder();
+
+    Decoder(const Decoder &) = delete;
+    Decoder & operator=(const Decoder &) = delete;
+
+    void setTxMode(TxMode txMode);
+    void setModulation(Modulation modulation);
+    // The Decoder logs from the thread that calls process() or decode()
+    void setLogCallback(LogCallback callback, void * userData = nullptr);
+    void setRxMode(RxMode rxMode);
+    void setSlidingHop(int hop);
+    void setAnalysisThreads(int nThreads);
+    void setParameters(int freqDelta, int freqStart, int framesPerTx, int bytesPerTx);
+
+    // Capture: push() appends samples to the capture ring and may be called from the audio
+    // callback - it never blocks and returns the number of samples accepted (the rest is
+    // counted in getSamplesDropped()). process() then decodes all complete frames in the ring
+    // and returns the number of messages decoded - see popRxData(). A completed recording is
+    // analyzed on a thread of its own while process() keeps listening for the next message,
+    // so its message is returned by one of the following calls. skip() drops the captured
+    // frames without decoding them, unless a message is being received.
+    int push(const float * samples, int nSamples);
+    int process();
+    void skip();
+
+    // push() and process() in one go, for when capture and decoding run on the same thread.
+    // The samples do not have to be frame-aligned. Waits for the analysis of the last
+    // recording, if any. Returns the number of messages decoded
+    int decode(const float * samples, int nSamples);
+
+    long long getSamplesDropped() const;
+
+    // The last decoded message
+    const uint8_t * getRxData() const;
+    int getRxDataLength() const;
+
+    // Every decoded message is also queued until it is taken, so that none is lost when one
+    // call decodes several. popRxData() copies the oldest one into dst, which must hold
+    // kMaxDataSize bytes, and returns its length - or -1 if there is none. Only the 16 most
+    // recent messages are kept
+    int popRxData(uint8_t * dst);
+    int getRxDataQueued() const;
+
+    // False while the input is silent
+    bool hasSignal() const;
+
+    int getSampleRate() const;
+    int getSamplesPerFrame() const;
+    float getAverageRxTime_ms() const;
+
+    // Frames of the message being recorded. In VariableLength mode the recording ends before
+    // the end marker arrives once the frames of its decoded length header have been analyzed
+    int getFramesToRecord() const;
+    int getFramesLeftToRecord() const;
+    int getFramesToAnalyze() const;
+    int getFramesLeftToAnalyze() const;
+
+    // Latency statistics of the receive stages since the start or the last reset. Read them
+    // from the thread that calls process()
+    const RxStageStats & getRxStageStats(RxStage stage) const;
+    void resetRxStageStats();
+    static const char * getRxStageName(RxStage stage);
+
+private:
+    DataRxTx * data;
+};
+
+#endif